@@ -0,0 +1,49 @@
+/**
+ *
+ * @file allocations.cpp
+ * @author Aydan Eng, Eric Cui
+ *
+ * Replacements of the global operator new and operator delete that count the heap allocations,
+ * linked into the microbenchmarks. They live in their own translation unit so that the compiler
+ * never inlines them into the code that allocates (it would then warn that memory from operator
+ * new is released with free).
+ *
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Every heap allocation of the program is counted
+static std::atomic<unsigned long long> allocations(0);
+
+/**
+ * \brief number of heap allocations so far
+ *
+ * @return the number of calls of operator new and operator new[] since the program started
+ *
+ */
+unsigned long long allocation_count()
+{
+    return allocations.load(std::memory_order_relaxed);
+}
+
+void *operator new(std::size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *memory = std::malloc(size ? size : 1))
+    {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *memory) noexcept { std::free(memory); }
+void operator delete[](void *memory) noexcept { std::free(memory); }
+void operator delete(void *memory, std::size_t) noexcept { std::free(memory); }
+void operator delete[](void *memory, std::size_t) noexcept { std::free(memory); }
@@ -0,0 +1,283 @@
+/**
+ *
+ * @file benchmark.cpp
+ * @author Aydan Eng, Eric Cui
+ *
+ * Microbenchmarks of the simulator hot paths. Run from the repository root (the end-to-end
+ * benchmarks load the scenarios in testing/): ./bin/benchmark [name filter]
+ * Each benchmark reports the time and the heap allocations per operation.
+ *
+ */
+
+#define INTERRUPTS_NO_MAIN
+#include "interrupts_aydaneng_ericcui.cpp"
+
+#include <chrono>
+
+#define BENCHMARK_MIN_TIME 0.2  //!< seconds each benchmark runs for (at least)
+#define BENCHMARK_NAME_WIDTH 64 //!< width of the name column (the longest name fits in it)
+
+// Heap allocations so far, counted by the operator new of allocations_aydaneng_ericcui.cpp
+unsigned long long allocation_count();
+
+// Results are kept here so the optimizer cannot drop the work
+static volatile long long sink_value = 0;
+
+/**
+ * \brief time a benchmark
+ *
+ * Runs 'run' (which does 'ops' operations) until BENCHMARK_MIN_TIME has passed, then prints the
+ * nanoseconds and the allocations per operation.
+ *
+ * @param filter only the benchmarks whose name contains the filter run
+ * @param name the name of the benchmark
+ * @param ops operations done by one call of run
+ * @param run the benchmark body
+ *
+ */
+template <typename Body>
+void measure(const std::string &filter, const std::string &name, std::size_t ops, const Body &run)
+{
+    if (name.find(filter) == std::string::npos)
+    {
+        return;
+    }
+
+    run(); // warm up
+
+    using clock = std::chrono::steady_clock;
+    unsigned long long first_allocation = allocation_count();
+    std::size_t runs = 0;
+    double elapsed = 0;
+    clock::time_point start = clock::now();
+    while (elapsed < BENCHMARK_MIN_TIME)
+    {
+        run();
+        runs++;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    }
+    unsigned long long allocated = allocation_count() - first_allocation;
+
+    double total_ops = double(runs) * ops;
+    printf("%-*s | %12.1f | %12.2f | %10zu\n", BENCHMARK_NAME_WIDTH, name.c_str(), elapsed * 1e9 / total_ops, allocated / total_ops, runs * ops);
+}
+
+// A synthetic trace of 'lines' instructions: CPU bursts, SYSCALLs and END_IOs on devices
+// 1 to 10, and (1% of the time) a FORK whose child EXECs 'program' (so it never runs the rest)
+std::string synthetic_trace(std::size_t lines, const std::string &program)
+{
+    std::mt19937 rng(42);
+    std::string trace;
+    for (std::size_t k = 0; k < lines; k++)
+    {
+        unsigned int draw = rng() % 100;
+        if (draw < 40)
+            trace += "CPU, " + std::to_string(1 + rng() % 50) + "\n";
+        else if (draw < 70)
+            trace += "SYSCALL, " + std::to_string(1 + rng() % 10) + "\n";
+        else if (draw < 99)
+            trace += "END_IO, " + std::to_string(1 + rng() % 10) + "\n";
+        else
+            trace += "FORK, 3\nIF_CHILD, 0\nEXEC " + program + ", 5\nIF_PARENT, 0\nENDIF, 0\n";
+    }
+    return trace;
+}
+
+// Runs a whole simulation, rendering the text logs to /dev/null (or recording nothing)
+int run_end_to_end(const simulation_context &context, bool text)
+{
+    simulator sim(context);
+    event_log events;
+    events.vectors = &context.vectors;
+
+    output_sink execution("/dev/null"), system_status("/dev/null"), metrics;
+    if (text)
+    {
+        events.execution = &execution;
+        events.system_status = &system_status;
+    }
+    events.recording = text;
+
+    return run_simulation(sim, events, metrics);
+}
+
+int main(int argc, char **argv)
+{
+    const std::string filter = argc > 1 ? argv[1] : "";
+
+    printf("%-*s | %12s | %12s | %10s\n", BENCHMARK_NAME_WIDTH, "benchmark", "ns/op", "allocs/op", "ops");
+
+    // Parsing: split_delim on external file lines, trace compilation (per line) and table loading
+    const std::size_t lines = 10000;
+    const std::string trace_text = synthetic_trace(lines, "program1");
+    const std::size_t trace_lines = std::count(trace_text.begin(), trace_text.end(), '\n');
+
+    measure(filter, "split_delim (external file line)", 1000, [&]()
+    {
+        for (int k = 0; k < 1000; k++)
+        {
+            sink_value += split_delim("program1, 10", ",").size();
+        }
+    });
+
+    measure(filter, "compile_trace (per line)", trace_lines, [&]()
+    {
+        program_registry programs;
+        std::istringstream input(trace_text);
+        sink_value += compile_trace(input, programs).instructions.size();
+    });
+
+    // Loading: a device table of a million rows (written to a temporary file)
+    const std::size_t table_rows = 1000000;
+    char table_file[] = "/tmp/benchmark_table_XXXXXX";
+    int table_fd = mkstemp(table_file);
+    if (table_fd != -1)
+    {
+        std::string table;
+        for (std::size_t row = 0; row < table_rows; row++)
+        {
+            table += std::to_string(row % 1000) + "\n";
+        }
+        sink_value += write(table_fd, table.data(), table.size());
+        ::close(table_fd);
+
+        measure(filter, "load_number_table (device table row)", table_rows, [&]()
+        {
+            sink_value += load_number_table<int>(table_file, "Expected a device delay").size();
+        });
+        unlink(table_file);
+    }
+
+    // Memory: allocate/free churn over the default table and over a large one
+    auto churn = [&](const std::string &name, const std::vector<unsigned int> &sizes, fit_policy policy)
+    {
+        partition_allocator memory;
+        init_memory(memory, sizes, policy);
+
+        std::vector<PCB> processes;
+        for (unsigned int pid = 0; pid < sizes.size() * 2; pid++)
+        {
+            processes.emplace_back(pid, -1, 0, 1 + (pid * 7919) % 40, -1);
+        }
+
+        std::mt19937 rng(7);
+        measure(filter, name, 1000, [&]()
+        {
+            for (int k = 0; k < 1000; k++)
+            {
+                PCB &process = processes[rng() % processes.size()];
+                if (process.partition_number == -1)
+                    sink_value += allocate_memory(memory, &process);
+                else
+                    free_memory(memory, &process);
+            }
+        });
+    };
+
+    std::vector<unsigned int> large_table;
+    for (unsigned int k = 0; k < 4096; k++)
+    {
+        large_table.push_back(1 + (k * 2654435761u) % 40);
+    }
+    churn("memory churn (6 partitions, best fit)", DEFAULT_PARTITIONS, fit_policy::BEST_FIT);
+    churn("memory churn (4096 partitions, best fit)", large_table, fit_policy::BEST_FIT);
+    churn("memory churn (4096 partitions, first fit)", large_table, fit_policy::FIRST_FIT);
+    churn("memory churn (4096 partitions, worst fit)", large_table, fit_policy::WORST_FIT);
+
+    // Formatting: the FORK handler steps and a PCB table, recorded then rendered
+    std::vector<unsigned int> vectors(26, 0x01E3);
+    output_sink null_sink("/dev/null");
+    simulation_context isr_context;
+    isr_context.vectors = vectors;
+    const std::vector<isr_step> fork_steps = steps_of(FORK_STEPS);
+
+    measure(filter, "FORK handler steps (record + render)", 1000, [&]()
+    {
+        simulator sim(isr_context);
+        event_log events;
+        events.vectors = &vectors;
+        int time = 0;
+        for (int k = 0; k < 1000; k++)
+        {
+            time = run_isr_steps(fork_steps, {1, 2, 0, 0, time}, time, sim, events, [](int) {});
+        }
+        render_execution(events, null_sink);
+    });
+
+    program_registry programs;
+    std::vector<PCB> processes;
+    std::vector<frame> frames;
+    for (unsigned int pid = 0; pid < 8; pid++)
+    {
+        processes.emplace_back(pid, pid - 1, intern_program(programs, "program" + std::to_string(pid)), 10, pid % 6 + 1);
+        frames.push_back({nullptr, 0, pid, 0});
+    }
+    instruction fork_instruction = {opcode::FORK, 10, 0, 0};
+
+    measure(filter, "print_PCB, 8 processes (record + render)", 100, [&]()
+    {
+        event_log events;
+        for (int k = 0; k < 100; k++)
+        {
+            record_PCB(events, k, fork_instruction, processes, frames, programs);
+        }
+        render_status(events, null_sink);
+    });
+
+    // End to end: the bundled scenarios, then scaled-up synthetic traces over test3's tables
+    for (int test = 1; test <= 6; test++)
+    {
+        const std::string dir = "testing/test" + std::to_string(test) + "/input_files/";
+        simulation_context context;
+        try
+        {
+            load_scenario(context, dir + "trace.txt", dir + "vector_table.txt", dir + "device_table.txt", dir + "external_files.txt", dir);
+        }
+        catch (const std::exception &error)
+        {
+            printf("%-*s | skipped: %s\n", BENCHMARK_NAME_WIDTH, ("simulate test" + std::to_string(test)).c_str(), error.what());
+            continue;
+        }
+
+        measure(filter, "simulate test" + std::to_string(test) + " (per run)", 1, [&]()
+        {
+            sink_value += run_end_to_end(context, true);
+        });
+    }
+
+    const std::string dir = "testing/test3/input_files/";
+    for (std::size_t scale : {10000, 100000, 1000000})
+    {
+        simulation_context context;
+        try
+        {
+            load_scenario(context, dir + "trace.txt", dir + "vector_table.txt", dir + "device_table.txt", dir + "external_files.txt", dir);
+        }
+        catch (const std::exception &error)
+        {
+            printf("%-*s | skipped: %s\n", BENCHMARK_NAME_WIDTH, "simulate synthetic", error.what());
+            break;
+        }
+
+        std::istringstream input(synthetic_trace(scale, "program1"));
+        context.trace = compile_trace(input, context.programs);
+
+        const std::string name = "simulate synthetic " + std::to_string(scale);
+        measure(filter, name + " (per instruction)", context.trace.instructions.size(), [&]()
+        {
+            sink_value += run_end_to_end(context, true);
+        });
+        measure(filter, name + ", no text (per instruction)", context.trace.instructions.size(), [&]()
+        {
+            sink_value += run_end_to_end(context, false);
+        });
+
+        context.paging = true; // every instruction goes through its page table
+        measure(filter, name + ", no text, paging (per instruction)", context.trace.instructions.size(), [&]()
+        {
+            sink_value += run_end_to_end(context, false);
+        });
+    }
+
+    return 0;
+}
@@ -3,4 +3,10 @@ if [ ! -d "bin" ]; then
 else
 	rm bin/*
 fi
-g++ -g -O0 -I . -o bin/interrupts interrupts_aydaneng_ericcui.cpp
\ No newline at end of file
+g++ -g -O0 -pthread -I . -o bin/interrupts interrupts_aydaneng_ericcui.cpp
+
+# Microbenchmarks (optimized): ./bin/benchmark [name filter], from this directory
+g++ -O2 -pthread -I . -o bin/benchmark benchmark_aydaneng_ericcui.cpp allocations_aydaneng_ericcui.cpp
+
+# Synthetic scenario generator: ./bin/generator <output_directory> [options]
+g++ -O2 -I . -o bin/generator generator_aydaneng_ericcui.cpp
@@ -0,0 +1,386 @@
+/**
+ *
+ * @file generator.cpp
+ * @author Aydan Eng, Eric Cui
+ *
+ * Synthetic scenario generator: writes trace.txt, program<N>.txt, external_files.txt,
+ * vector_table.txt, device_table.txt and partitions.txt (for --partitions) into a directory,
+ * in the simulator's input format. The same options and seed always give the same scenario.
+ *
+ * Usage: ./generator <output_directory> [options] (see print_generator_usage)
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <charconv>
+#include <string_view>
+#include <stdio.h>
+#include <cstdlib>
+#include <sys/stat.h>
+
+// Parameters of a scenario
+struct generator_options
+{
+    std::string directory;
+
+    unsigned long lines = 1000;      // instructions of the trace (top level, nested FORK blocks come on top)
+    unsigned int cpu_weight = 60;    // mix of the generated work
+    unsigned int syscall_weight = 20;
+    unsigned int end_io_weight = 20;
+    double fork_rate = 0.01;         // chance that a top-level line is a FORK tree
+    unsigned int fork_depth = 1;     // nesting depth of a FORK tree (a child FORKs again inside its block)
+    unsigned int fork_fanout = 1;    // FORKs per child block of a FORK tree
+    unsigned int block_lines = 2;    // work lines in each IF_CHILD/IF_PARENT block
+
+    unsigned int programs = 4;       // program1 ... programN
+    unsigned int program_lines = 20; // work lines of each program
+    unsigned int exec_chain = 1;     // programs per EXEC chain (program k EXECs program k + 1 within a chain)
+    unsigned int size_min = 1;       // program sizes, uniform in [size_min, size_max] Mb
+    unsigned int size_max = 20;
+
+    unsigned int devices = 20;       // device table entries (and vectors used by SYSCALL/END_IO)
+    unsigned int vectors = 26;       // vector table entries
+    unsigned int delay_min = 50;     // device delays, uniform in [delay_min, delay_max] ms
+    unsigned int delay_max = 500;
+    unsigned int cpu_min = 1;        // CPU bursts, uniform in [cpu_min, cpu_max] ms
+    unsigned int cpu_max = 100;
+    unsigned int partitions = 0;     // partitions.txt entries (0: no file)
+
+    unsigned int seed = 1;
+};
+
+void print_generator_usage()
+{
+    std::cout << "To generate a scenario, do: ./generator <output_directory> [options]" << std::endl;
+    std::cout << "Options: --lines <N>                        trace length (default: 1000)" << std::endl;
+    std::cout << "         --mix <cpu>,<syscall>,<end_io>     relative weights of the work lines (default: 60,20,20)" << std::endl;
+    std::cout << "         --fork-rate <p>                    chance that a trace line is a FORK tree (default: 0.01)" << std::endl;
+    std::cout << "         --fork-depth <D>                   nesting depth of a FORK tree (default: 1)" << std::endl;
+    std::cout << "         --fork-fanout <F>                  FORKs in each child block (default: 1)" << std::endl;
+    std::cout << "         --block-lines <N>                  work lines in each IF_CHILD/IF_PARENT block (default: 2)" << std::endl;
+    std::cout << "         --programs <N>                     number of programs (default: 4)" << std::endl;
+    std::cout << "         --program-lines <N>                work lines of each program (default: 20)" << std::endl;
+    std::cout << "         --exec-chain <L>                   programs per EXEC chain (default: 1)" << std::endl;
+    std::cout << "         --sizes <min>,<max>                program sizes in Mb (default: 1,20)" << std::endl;
+    std::cout << "         --devices <N>                      device table entries (default: 20)" << std::endl;
+    std::cout << "         --vectors <N>                      vector table entries (default: 26)" << std::endl;
+    std::cout << "         --delays <min>,<max>               device delays in ms (default: 50,500)" << std::endl;
+    std::cout << "         --bursts <min>,<max>               CPU bursts in ms (default: 1,100)" << std::endl;
+    std::cout << "         --partitions <N>                   also write a partition table of N partitions (default: none)" << std::endl;
+    std::cout << "         --seed <S>                         random seed (default: 1)" << std::endl;
+}
+
+// Parses a whole text as one number (no blanks, no sign for an unsigned number); false if it is not one
+template <typename T>
+bool parse_number(std::string_view text, T &number)
+{
+    auto [last, error] = std::from_chars(text.data(), text.data() + text.size(), number);
+    return !text.empty() && error == std::errc() && last == text.data() + text.size();
+}
+
+// Parses the value of a numeric option, exits naming what was expected if it is not one
+template <typename T>
+T option_number(const std::string &option, const std::string &value, const char *expected)
+{
+    T number{};
+    if (!parse_number(value, number))
+    {
+        std::cerr << "Error: Expected " << expected << " after " << option << ", received " << value << std::endl;
+        exit(1);
+    }
+    return number;
+}
+
+// Parses "<a>,<b>" into two numbers, exits if the value is malformed
+void parse_pair(const std::string &option, const std::string &value, unsigned int &first, unsigned int &second)
+{
+    const std::size_t comma = value.find(',');
+    const std::string_view text(value);
+    if (comma == std::string::npos || !parse_number(text.substr(0, comma), first) ||
+        !parse_number(text.substr(comma + 1), second) || second < first)
+    {
+        std::cerr << "Error: Expected <min>,<max> after " << option << ", received " << value << std::endl;
+        exit(1);
+    }
+}
+
+generator_options parse_generator_args(int argc, char **argv)
+{
+    if (argc < 2 || argv[1][0] == '-')
+    {
+        std::cout << "ERROR!\nExpected an output directory" << std::endl;
+        print_generator_usage();
+        exit(1);
+    }
+
+    generator_options options;
+    options.directory = argv[1];
+    if (options.directory.back() != '/')
+    {
+        options.directory += '/';
+    }
+
+    for (int i = 2; i < argc; i += 2)
+    {
+        std::string option = argv[i];
+        if (i + 1 >= argc)
+        {
+            std::cerr << "Error: Expected a value after " << option << std::endl;
+            exit(1);
+        }
+        std::string value = argv[i + 1];
+
+        if (option == "--lines")
+            options.lines = option_number<unsigned long>(option, value, "a number of lines");
+        else if (option == "--mix")
+        {
+            const std::string_view text(value);
+            const std::size_t first = text.find(','), second = text.find(',', first + 1);
+            const bool parsed = first != std::string::npos && second != std::string::npos &&
+                                parse_number(text.substr(0, first), options.cpu_weight) &&
+                                parse_number(text.substr(first + 1, second - first - 1), options.syscall_weight) &&
+                                parse_number(text.substr(second + 1), options.end_io_weight);
+            if (!parsed || options.cpu_weight + options.syscall_weight + options.end_io_weight == 0)
+            {
+                std::cerr << "Error: Expected <cpu>,<syscall>,<end_io> after --mix, received " << value << std::endl;
+                exit(1);
+            }
+        }
+        else if (option == "--fork-rate")
+        {
+            options.fork_rate = option_number<double>(option, value, "a probability (0 to 1)");
+            if (!(options.fork_rate >= 0 && options.fork_rate <= 1))
+            {
+                std::cerr << "Error: Expected a probability (0 to 1) after --fork-rate, received " << value << std::endl;
+                exit(1);
+            }
+        }
+        else if (option == "--fork-depth")
+            options.fork_depth = option_number<unsigned int>(option, value, "a depth");
+        else if (option == "--fork-fanout")
+            options.fork_fanout = option_number<unsigned int>(option, value, "a number of FORKs");
+        else if (option == "--block-lines")
+            options.block_lines = option_number<unsigned int>(option, value, "a number of lines");
+        else if (option == "--programs")
+            options.programs = option_number<unsigned int>(option, value, "a number of programs");
+        else if (option == "--program-lines")
+            options.program_lines = option_number<unsigned int>(option, value, "a number of lines");
+        else if (option == "--exec-chain")
+            options.exec_chain = option_number<unsigned int>(option, value, "a number of programs");
+        else if (option == "--sizes")
+            parse_pair(option, value, options.size_min, options.size_max);
+        else if (option == "--devices")
+            options.devices = option_number<unsigned int>(option, value, "a number of devices");
+        else if (option == "--vectors")
+            options.vectors = option_number<unsigned int>(option, value, "a number of vectors");
+        else if (option == "--delays")
+            parse_pair(option, value, options.delay_min, options.delay_max);
+        else if (option == "--bursts")
+            parse_pair(option, value, options.cpu_min, options.cpu_max);
+        else if (option == "--partitions")
+            options.partitions = option_number<unsigned int>(option, value, "a number of partitions");
+        else if (option == "--seed")
+            options.seed = option_number<unsigned int>(option, value, "a seed");
+        else
+        {
+            std::cerr << "Error: Unknown option: " << option << std::endl;
+            exit(1);
+        }
+    }
+
+    // The handlers index both tables with the device number and split each delay with '%'
+    if (options.devices == 0 || options.vectors < options.devices || options.delay_min == 0)
+    {
+        std::cerr << "Error: Expected at least one device, as many vectors as devices, and delays of at least 1 ms" << std::endl;
+        exit(1);
+    }
+    if (options.programs == 0 || options.exec_chain == 0 || options.fork_fanout == 0)
+    {
+        std::cerr << "Error: Expected at least one program, and EXEC chains and FORK fan-outs of at least 1" << std::endl;
+        exit(1);
+    }
+
+    return options;
+}
+
+// Writes the scenario files. Work lines are drawn from the mix; a FORK tree of depth d is
+//   FORK / IF_CHILD / work / fanout x (tree of depth d - 1) / EXEC / IF_PARENT / work / ENDIF
+// Every child ends with an EXEC, so it never runs the code after its ENDIF: the number of
+// processes grows with the trees, not exponentially with the trace.
+struct scenario_generator
+{
+    const generator_options &options;
+    std::mt19937 rng;
+    std::ofstream output_file; // the file being written
+    std::string buffer;        // its lines not written yet
+    std::string filename;
+
+    scenario_generator(const generator_options &_options) : options(_options), rng(_options.seed) {}
+
+    unsigned int uniform(unsigned int min, unsigned int max)
+    {
+        return min + rng() % (max - min + 1);
+    }
+
+    void work_line()
+    {
+        unsigned int draw = rng() % (options.cpu_weight + options.syscall_weight + options.end_io_weight);
+        if (draw < options.cpu_weight)
+            buffer += "CPU, " + std::to_string(uniform(options.cpu_min, options.cpu_max)) + "\n";
+        else if (draw < options.cpu_weight + options.syscall_weight)
+            buffer += "SYSCALL, " + std::to_string(rng() % options.devices) + "\n";
+        else
+            buffer += "END_IO, " + std::to_string(rng() % options.devices) + "\n";
+    }
+
+    void work(unsigned int lines)
+    {
+        for (unsigned int k = 0; k < lines; k++)
+        {
+            work_line();
+        }
+    }
+
+    // EXEC of the first program of a random chain
+    void exec_line()
+    {
+        unsigned int chains = (options.programs + options.exec_chain - 1) / options.exec_chain;
+        unsigned int program = 1 + (rng() % chains) * options.exec_chain;
+        buffer += "EXEC program" + std::to_string(program) + ", " + std::to_string(uniform(1, 50)) + "\n";
+    }
+
+    // A FORK tree, with an explicit stack so that 10k-deep trees are fine
+    void fork_tree(unsigned int depth)
+    {
+        std::vector<unsigned int> forks_left; // per open level: FORKs still to write in its child block
+        forks_left.push_back(1);
+        while (!forks_left.empty())
+        {
+            if (forks_left.back() == 0)
+            {
+                // close the level: the child EXECs, then the parent block
+                forks_left.pop_back();
+                if (forks_left.empty())
+                {
+                    break;
+                }
+                exec_line();
+                buffer += "IF_PARENT, 0\n";
+                work(options.block_lines);
+                buffer += "ENDIF, 0\n";
+                continue;
+            }
+
+            forks_left.back()--;
+            buffer += "FORK, " + std::to_string(uniform(1, 20)) + "\n";
+            buffer += "IF_CHILD, 0\n";
+            work(options.block_lines);
+            forks_left.push_back(forks_left.size() < depth ? options.fork_fanout : 0);
+        }
+    }
+
+    void begin_file(const std::string &name)
+    {
+        filename = options.directory + name;
+        output_file.open(filename);
+    }
+
+    // Writes the buffered lines
+    void flush()
+    {
+        output_file.write(buffer.data(), buffer.size());
+        if (!output_file)
+        {
+            std::cerr << "Error: Unable to write file: " << filename << std::endl;
+            exit(1);
+        }
+        buffer.clear();
+    }
+
+    void end_file()
+    {
+        flush();
+        output_file.close();
+    }
+
+    void generate()
+    {
+        // trace.txt, written in chunks of about 1 MB
+        begin_file("trace.txt");
+        for (unsigned long line = 0; line < options.lines; line++)
+        {
+            if (options.fork_rate > 0 && std::generate_canonical<double, 32>(rng) < options.fork_rate)
+                fork_tree(options.fork_depth);
+            else
+                work_line();
+
+            if (buffer.size() >= (1 << 20))
+            {
+                flush();
+            }
+        }
+        end_file();
+
+        // program<N>.txt, each chain ending with a program that does not EXEC
+        for (unsigned int program = 1; program <= options.programs; program++)
+        {
+            begin_file("program" + std::to_string(program) + ".txt");
+            work(options.program_lines);
+            if (program % options.exec_chain != 0 && program < options.programs)
+            {
+                buffer += "EXEC program" + std::to_string(program + 1) + ", " + std::to_string(uniform(1, 50)) + "\n";
+            }
+            end_file();
+        }
+
+        begin_file("external_files.txt");
+        for (unsigned int program = 1; program <= options.programs; program++)
+        {
+            buffer += "program" + std::to_string(program) + ", " + std::to_string(uniform(options.size_min, options.size_max)) + "\n";
+        }
+        end_file();
+
+        begin_file("vector_table.txt");
+        for (unsigned int vector = 0; vector < options.vectors; vector++)
+        {
+            char address[16];
+            snprintf(address, sizeof(address), "0X%04X", uniform(0, 0x7FF) * 2);
+            buffer += std::string(address) + "\n";
+        }
+        end_file();
+
+        begin_file("device_table.txt");
+        for (unsigned int device = 0; device < options.devices; device++)
+        {
+            buffer += std::to_string(uniform(options.delay_min, options.delay_max)) + "\n";
+        }
+        end_file();
+
+        if (options.partitions > 0)
+        {
+            begin_file("partitions.txt");
+            for (unsigned int partition = 0; partition < options.partitions; partition++)
+            {
+                buffer += std::to_string(uniform(options.size_min, options.size_max * 2)) + "\n";
+            }
+            end_file();
+        }
+    }
+};
+
+int main(int argc, char **argv)
+{
+    generator_options options = parse_generator_args(argc, argv);
+
+    mkdir(options.directory.c_str(), 0755); // may already exist
+
+    scenario_generator generator(options);
+    generator.generate();
+
+    std::cout << "Scenario generated in " << options.directory << std::endl;
+    return 0;
+}
@@ -7,393 +7,1991 @@
 
 #include "interrupts_aydaneng_ericcui.hpp"
 
-static unsigned int next_pid = 1;
-
-std::tuple<std::string, std::string, int> simulate_trace(std::vector<std::string> trace_file, int time, std::vector<std::string> vectors, std::vector<int> delays, std::vector<external_file> external_files, PCB current, std::vector<PCB> wait_queue)
+// Drains the events (so the text logs are complete up to here) and appends the state of
+// simulate_trace and of the simulator to the checkpoint file
+void save_checkpoint(simulator &sim, event_log &events, int time, std::size_t last_line, const std::vector<PCB> &processes, const std::vector<frame> &frames)
 {
+    events.drain();
 
-    std::string trace;              //!< string to store single line of trace file
-    std::string execution = "";     //!< string to accumulate the execution output
-    std::string system_status = ""; //!< string to accumulate the system status output
-    int current_time = time;
+    std::ostringstream rng;
+    rng << sim.rng;
 
-    // parse each line of the input trace file. 'for' loop to keep track of indices.
-    for (size_t i = 0; i < trace_file.size(); i++)
+    checkpoint state = {time, sim.next_pid, last_line,
+                        events.execution != nullptr ? events.execution->offset() : 0,
+                        events.system_status != nullptr ? events.system_status->offset() : 0,
+                        rng.str(), {}, sim.memory.bucket_free, processes, frames, sim.finish_times, sim.stats};
+    for (const auto &partition : sim.memory.partitions)
     {
-        auto trace = trace_file[i];
-
-        auto [activity, duration_intr, program_name] = parse_trace(trace);
+        state.occupants.push_back(partition.occupant);
+    }
+    write_checkpoint(*sim.checkpoints, state, sim.context);
+}
 
-        if (activity == "CPU")
-        { // As per Assignment 1
-            execution += std::to_string(current_time) + ", " + std::to_string(duration_intr) + ", CPU Burst\n";
-            current_time += duration_intr;
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Parallel FORK branches (--parallel-forks): when a FORK succeeds, the child runs on as usual and
+// the parent's code after it (down to the end of the parent) runs at the same time on another
+// thread, as a speculative branch. The branch starts at time 0, from the partition table the
+// child will leave behind if its subtree frees what it took (the free lists are LIFO, so it
+// usually does), with PIDs numbered from the child's next one and without drawing the device
+// delays. When the child ends, the branch is merged: its events are re-timed after the child,
+// its PIDs renumbered after the ones the child's subtree took, and its delays drawn in the
+// sequential order, so the logs are the ones of the sequential run. If the partition table is
+// not the one the branch started from, the branch is dropped and the parent runs serially.
+// A branch merged into another branch is kept as it is: its events are only replayed (once)
+// when the outermost branch is merged into the simulation. A branch costs its parent's frame,
+// a copy of the partition table and its events: at most PARALLEL_FORK_MAX_BRANCHES are kept,
+// PARALLEL_FORK_MAX_NESTING deep, and the parents past that run serially.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct fork_branch;
+
+// A branch merged into another one
+struct merged_branch
+{
+    std::unique_ptr<fork_branch> branch;
+    std::size_t event;      // events of the other branch before the ones of this one
+    std::size_t span;       // ... and delay spans
+    int time;               // when it started, in the time of the other branch
+    unsigned int pid_shift; // added to the PIDs of its processes
+    bool parent_fixed;      // its parent's frame was inherited by the other branch as well
+};
+
+struct fork_branch
+{
+    simulator sim;
+    event_log events;                             // no consumer: the events stay in memory until the merge
+    std::vector<PCB> processes;                   // the parent's PCB, then the ones of the processes it forked
+    std::vector<frame> frames;                    // the parent's frame, then theirs
+    std::shared_ptr<const waiting_process> below; // the processes waiting below the parent (shared)
+    std::size_t levels_below;                     // ... how many
+    std::size_t nesting;                          // branches it was spawned from (0: spawned by the simulation)
+    std::vector<merged_branch> merged;            // the branches merged into this one, in order
+    uint64_t start_partitions;                    // fingerprint of the partition table the branch started from
+    unsigned int pid_base;                        // the first PID of the branch
+    std::size_t depth;                            // frames of the simulation once the child ended
+    std::size_t known_names;                      // names of the branch's event log that are the simulation's
+    int end_time = 0;                             // when the parent ended, from the branch's start
+    std::exception_ptr error;
+    std::atomic<bool> cancelled{false};           // set when the branch is dropped: it stops at its next instruction
+    std::atomic<fork_branch *> waiting{nullptr};  // the branch it waits for, to merge it
+    std::unique_ptr<fork_branch> dropped;         // that branch, if this one was dropped meanwhile
+    std::thread worker;
+
+    fork_branch(const simulation_context &context) : sim(context) {}
+
+    // A branch that was not merged is dropped, and the one it waits for with it (the ones it was
+    // running are dropped when it stops)
+    ~fork_branch()
+    {
+        for (fork_branch *dropped = this; dropped != nullptr; dropped = dropped->waiting)
+        {
+            dropped->cancelled = true;
         }
-        else if (activity == "SYSCALL")
-        { // As per Assignment 1
+        if (worker.joinable())
+        {
+            worker.join();
+        }
+        sim.pool->drop_branch();
+    }
+};
 
-            // From Assignment 1
-            execution.append(std::to_string(time) + ", 1, Switch to kernel mode\n");
-            current_time += 1;
-            execution.append(std::to_string(time) + ", 4, context saved\n");
-            current_time += 4;
-            execution.append(std::to_string(time) + ", 1, find vector " + std::to_string(duration_intr) + " in memory " + vectors[duration_intr] + "\n");
-            current_time += 1;
-            execution.append(std::to_string(time) + ", 1, obtain ISR address\n");
-            current_time += 1;
-
-            int remaining_io = delays[duration_intr];
-
-            int random_number = rand() % remaining_io - 2;
-            execution.append(std::to_string(current_time) + ", " + std::to_string(random_number) + ", Call device driver\n");
-            current_time += random_number;
-            remaining_io = remaining_io - random_number;
-
-            random_number = rand() % remaining_io - 1;
-            execution.append(std::to_string(current_time) + ", " + std::to_string(random_number) + ", Perform device check\n");
-            current_time += random_number;
-            remaining_io = remaining_io - random_number;
-
-            random_number = remaining_io;
-            execution.append(std::to_string(current_time) + ", " + std::to_string(random_number) + ", Send device instruction\n");
-            current_time += random_number;
-            remaining_io = remaining_io - random_number;
-
-            execution += std::to_string(current_time) + ", 1, IRET\n";
-            current_time += 1;
-        }
-        else if (activity == "END_IO")
-        {
-            execution.append(std::to_string(current_time) + ", 1, switch to kernel mode\n");
-            current_time += 1;
-            execution.append(std::to_string(current_time) + ", 4, context saved\n");
-            current_time += 4;
-            execution.append(std::to_string(current_time) + ", 1, find vector " + std::to_string(duration_intr) + " in memory " + vectors[duration_intr] + "\n");
-            current_time += 1;
-
-            // IO operations
-            int remaining_io = delays[duration_intr];
-            int random_number = rand() % remaining_io - 2;
-            execution.append(std::to_string(current_time) + ", " + std::to_string(random_number) + ", store information in memory\n");
-            current_time += random_number;
-            remaining_io = remaining_io - random_number;
-
-            random_number = rand() % remaining_io - 1;
-            execution.append(std::to_string(current_time) + ", " + std::to_string(random_number) + ", reset the io operation\n");
-            current_time += random_number;
-            remaining_io = remaining_io - random_number;
-
-            random_number = remaining_io;
-            execution.append(std::to_string(current_time) + ", " + std::to_string(random_number) + ", Send standby instruction\n");
-            current_time += random_number;
-            remaining_io = remaining_io - random_number;
-
-            execution += std::to_string(current_time) + ", 1, IRET\n";
-            current_time += 1;
-        }
-        else if (activity == "FORK")
-        {
-            auto [intr, time] = intr_boilerplate(current_time, 2, 10, vectors);
-            execution += intr;
-            current_time = time;
-
-            ///////////////////////////////////////////////////////////////////////////////////////////
-            // Add your FORK output here
-
-            // a. and b. copies the information needed fr4om the PCB of parent process to child process
-            execution += std::to_string(current_time) + ", " + std::to_string(duration_intr) + ", cloning the PCB\n";
-            current_time += duration_intr;
+int run_frames(const compiled_trace &init_trace, simulator &sim, event_log &events, std::vector<PCB> &processes, std::vector<frame> &frames,
+               int current_time, std::size_t stop_depth, std::size_t &last_line, trace_reader *stream, fork_branch *self = nullptr);
 
-            // Create the child PCB
-            PCB child_process = current;
-            child_process.PID = next_pid;
-            next_pid += 1;
+// Fingerprint of how a partition table will place the next programs: its occupants and the
+// order of its free lists
+uint64_t partitions_fingerprint(const partition_allocator &memory)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (const auto &partition : memory.partitions)
+    {
+        hash = fnv1a(hash, &partition.occupant, sizeof(partition.occupant));
+    }
+    for (const auto &list : memory.bucket_free)
+    {
+        const std::size_t count = list.size();
+        hash = fnv1a(hash, &count, sizeof(count));
+        hash = fnv1a(hash, list.data(), count * sizeof(unsigned int));
+    }
+    return hash;
+}
 
-            child_process.partition_number = -1;
-            if (!allocate_memory(&child_process))
-            {
-                // Log failure and IRET
-                execution += std::to_string(current_time) + ", 0, FORK failed: No memory for child process\n";
-                execution += std::to_string(current_time) + ", 1, IRET\n";
-                current_time += 1;
+// Starts the branch of the parent of the child that was just pushed on 'frames', on a thread
+// taken from sim.pool. 'waiting' holds the shared node of the frames below the top that already
+// have one, 'self' is the branch the simulation runs (nullptr: it is not a branch).
+std::unique_ptr<fork_branch> spawn_branch(const compiled_trace &init_trace, simulator &sim, const event_log &events, const std::vector<PCB> &processes,
+                                          const std::vector<frame> &frames, std::vector<std::shared_ptr<const waiting_process>> &waiting,
+                                          const fork_branch *self)
+{
+    auto branch = std::make_unique<fork_branch>(sim.context);
+    branch->depth = frames.size() - 1;
+    const std::size_t parent = branch->depth - 1;
+
+    // The processes below the parent are shared: each one gets its node once, while it waits
+    for (std::size_t level = waiting.size(); level < parent; level++)
+    {
+        waiting.push_back(std::make_shared<const waiting_process>(
+            waiting_process{processes[level], level > 0 ? waiting[level - 1] : self != nullptr ? self->below : nullptr}));
+    }
+    branch->below = parent > 0 ? waiting[parent - 1] : self != nullptr ? self->below : nullptr;
+    branch->levels_below = (self != nullptr ? self->levels_below : 0) + parent;
+    branch->nesting = self != nullptr ? self->nesting + 1 : 0;
+    branch->processes.push_back(processes[parent]);
+    branch->frames.push_back(frames[parent]);
+    branch->frames[0].process = 0;
+    branch->frames[0].fixed_start = true;
+
+    simulator &fork = branch->sim;
+    fork.pool = sim.pool;
+    fork.speculative = true;
+    fork.memory = sim.memory;
+    PCB child = processes.back();
+    free_memory(fork.memory, &child);
+    branch->start_partitions = partitions_fingerprint(fork.memory);
+    fork.next_pid = branch->pid_base = sim.next_pid;
+    fork.stats.host_timing = false;
+    fork.stats.occupied = fork.stats.peak_occupied = fork.memory.occupied;
+
+    // The branch interns names over a copy of the simulation's, so the ones known at this point
+    // keep their index
+    event_log &log = branch->events;
+    log.recording = events.recording;
+    log.names = events.names;
+    log.name_ids = events.name_ids;
+    log.program_names = events.program_names;
+    branch->known_names = log.names.size();
+
+    fork_branch *running = branch.get();
+    branch->worker = std::thread([&init_trace, running]()
+    {
+        try
+        {
+            std::size_t last_line = 0;
+            running->end_time = run_frames(init_trace, running->sim, running->events, running->processes, running->frames,
+                                           0, 0, last_line, nullptr, running);
+        }
+        catch (...)
+        {
+            running->error = std::current_exception();
+        }
+        running->sim.pool->release();
+    });
+    return branch;
+}
 
-                // Find IF_PARENT block, execute its contents, and jump 'i' past ENDIF.
-                int parent_index = -1;
-                int endif_index = -1;
+// Draws the device delays of spans[first, last), that a branch left undrawn, and re-times the
+// events of each span
+void resolve_spans(const std::vector<delay_span> &spans, std::size_t first, std::size_t last, event_log &events, std::mt19937 &rng)
+{
+    for (std::size_t k = first; k < last; k++)
+    {
+        const delay_span &span = spans[k];
+        int remaining = span.delay;
+        int time = span.time;
+        for (std::size_t s = 0; s < span.count; s++)
+        {
+            const isr_step &step = span.steps[s];
+            const std::size_t event = span.first + s;
+            int duration = events.recording ? events.duration[event] : 0;
+            if (step.cost == step_cost::DELAY_RANDOM)
+            {
+                duration = static_cast<int>(rng() % remaining) - step.value;
+                remaining -= duration;
+            }
+            else if (step.cost == step_cost::DELAY_REST)
+            {
+                duration = remaining;
+            }
 
-                for (size_t j = i + 1; j < trace_file.size(); j++)
+            if (events.recording)
+            {
+                events.duration[event] = duration;
+                if (!step.frame_time)
                 {
-                    auto [activity_j, _d, _pn] = parse_trace(trace_file[j]);
-                    if (activity_j == "IF_PARENT")
-                    {
-                        parent_index = j; // Parent code starts here
-                    }
-                    else if (activity_j == "ENDIF")
-                    {
-                        endif_index = j;
-                        if (parent_index == -1)
-                        {                     // No IF_PARENT block
-                            parent_index = j; // Parent resumes after ENDIF
-                        }
-                        break;
-                    }
+                    events.time[event] = time;
                 }
+            }
+            time += step.advance == LOGGED_TIME ? duration : step.advance;
+        }
+    }
+}
 
-                // 3. Set the main loop's index 'i' to resume at the parent's code
-                if (parent_index != -1)
-                {
-                    i = parent_index; // The loop will increment to the line *after* IF_PARENT
-                }
-                else if (endif_index != -1)
-                {
-                    i = endif_index;
-                }
-                else
-                {
-                    i = trace_file.size(); // Stop the loop if ENDIF is missing
-                }
+// How the events of a branch are replayed into the simulation's event log. 'outer' is the view
+// of the branch it was merged into (nullptr: it was merged into the simulation).
+struct replay_view
+{
+    replay_view *outer;
+    fork_branch &branch;
+    event_log &events;           // the simulation's
+    int time;                    // added to the times of the branch
+    int fixed_time;              // ... to the times of the events stamped with its parent's start
+    unsigned int pid_shift;      // added to the PIDs of the branch's processes
+    unsigned int first_pid;      // the PIDs below it are the same in every view
+    uint32_t first_name;         // the names below it are the same in every view
+    std::vector<uint32_t> names; // index in the simulation's log of each name of the branch (NO_NAME: not yet)
+
+    unsigned int pid(unsigned int branch_pid)
+    {
+        if (branch_pid >= branch.pid_base)
+        {
+            return branch_pid + pid_shift;
+        }
+        return branch_pid < first_pid || outer == nullptr ? branch_pid : outer->pid(branch_pid);
+    }
 
-                continue;
+    // (interned in the order the sequential run would have)
+    uint32_t name(uint32_t branch_name)
+    {
+        if (branch_name < first_name)
+        {
+            return branch_name;
+        }
+        uint32_t &interned = names[branch_name];
+        if (interned == NO_NAME)
+        {
+            if (branch_name >= branch.known_names)
+                interned = events.intern(branch.events.names[branch_name]);
+            else
+                interned = outer == nullptr ? branch_name : outer->name(branch_name);
+        }
+        return interned;
+    }
+};
+
+// Replays the events of a branch and of the branches merged into it, in the sequential order,
+// drawing their device delays on the way
+void replay_branch(replay_view &view, std::mt19937 &rng)
+{
+    fork_branch &branch = view.branch;
+    event_log &log = branch.events;
+    const std::vector<std::size_t> &fixed_events = branch.sim.fixed_events;
+    std::size_t event = 0, span = 0, fixed = 0;
+
+    auto replay_until = [&](std::size_t last_event, std::size_t last_span)
+    {
+        resolve_spans(branch.sim.spans, span, last_span, log, rng);
+        span = last_span;
+        for (; event < last_event; event++)
+        {
+            int time = log.time[event] + view.time;
+            if (fixed < fixed_events.size() && fixed_events[fixed] == event)
+            {
+                time = log.time[event] + view.fixed_time;
+                fixed++;
             }
+            view.events.add(time, log.duration[event], log.kind[event], view.pid(log.pid[event]), log.number[event], log.partition[event],
+                            view.name(log.name[event]), log.core[event]);
+        }
+    };
+
+    for (auto &inner : branch.merged)
+    {
+        replay_until(inner.event, inner.span);
+        replay_view inner_view = {&view, *inner.branch, view.events, inner.time + view.time, inner.parent_fixed ? view.fixed_time : view.time,
+                                  inner.pid_shift + view.pid_shift, view.first_pid, view.first_name,
+                                  std::vector<uint32_t>(inner.branch->events.names.size(), NO_NAME)};
+        replay_branch(inner_view, rng);
+        inner.branch.reset();
+    }
+    replay_until(log.size(), branch.sim.spans.size());
+}
+
+/**
+ * \brief merge a branch into the simulation it was spawned from
+ *
+ * The simulation is where the branch started, its child having just ended at 'time'. The
+ * branch's finish times and counters are added to the simulation's, and its partition table and
+ * PID counter take over; its events are replayed into the event log, or kept with it if the
+ * simulation is itself a branch. The caller pops the parent, which ended at the new 'time'.
+ *
+ * @param branch the branch, joined here
+ * @param sim the simulation
+ * @param events the simulation's event log
+ * @param frames the simulation's frames, the parent's on top
+ * @param time the simulation's time, moved to the end of the branch
+ * @param self the branch the simulation runs (nullptr: it is not a branch)
+ * @return false if the partition table is not the one the branch started from (the branch is
+ *         dropped, nothing is merged)
+ *
+ */
+bool merge_branch(std::unique_ptr<fork_branch> branch, simulator &sim, event_log &events, const std::vector<frame> &frames, int &time,
+                  fork_branch *self)
+{
+    if (partitions_fingerprint(sim.memory) != branch->start_partitions)
+    {
+        sim.stats.branches_rerun++;
+        return false; // (the branch is dropped as it is, it does not have to end first)
+    }
+
+    // (the thread does not count as working while it waits)
+    if (self != nullptr)
+    {
+        self->waiting = branch.get();
+    }
+    if (self == nullptr || !self->cancelled)
+    {
+        sim.pool->release();
+        branch->worker.join();
+        sim.pool->reclaim();
+    }
+    if (self != nullptr && self->cancelled)
+    {
+        // whoever drops this branch may still be walking to the one it waited for: it goes last
+        self->dropped = std::move(branch);
+        return false;
+    }
+    if (self != nullptr)
+    {
+        self->waiting = nullptr;
+    }
+    if (branch->error)
+    {
+        std::rethrow_exception(branch->error);
+    }
 
-            // Update parent PCB in the wait queue and have child PCB as current running process
-            PCB parent_process = current;
-            wait_queue.push_back(parent_process);
-            current = child_process;
+    const simulator &fork = branch->sim;
+    const unsigned int pid_shift = sim.next_pid - branch->pid_base;
+    for (const auto &[pid, finish] : fork.finish_times)
+    {
+        sim.finish_times.emplace_back(pid >= branch->pid_base ? pid + pid_shift : pid, finish + time);
+    }
 
-            // c. Scheduler call
-            execution += std::to_string(current_time) + ", 0, scheduler called\n";
-            current_time += 1;
+    run_stats &stats = sim.stats;
+    for (std::size_t op = 0; op < OPCODE_COUNT; op++)
+    {
+        stats.executed[op] += fork.stats.executed[op];
+    }
+    stats.fork_success += fork.stats.fork_success;
+    stats.fork_failed += fork.stats.fork_failed;
+    stats.exec_success += fork.stats.exec_success;
+    stats.exec_failed += fork.stats.exec_failed;
+    stats.max_wait_queue = std::max(stats.max_wait_queue, fork.stats.max_wait_queue);
+    stats.max_depth = std::max(stats.max_depth, fork.stats.max_depth);
+    stats.branches_merged += fork.stats.branches_merged + 1;
+    stats.branches_rerun += fork.stats.branches_rerun;
+    stats.exec_latencies += fork.stats.exec_latencies;
+    stats.exec_latency_total += fork.stats.exec_latency_total;
+    stats.exec_latency_max = std::max(stats.exec_latency_max, fork.stats.exec_latency_max);
+
+    sim.track_occupancy(time);
+    for (std::size_t level = 0; level < stats.time_at_occupancy.size(); level++)
+    {
+        stats.time_at_occupancy[level] += fork.stats.time_at_occupancy[level];
+    }
+    stats.occupied = fork.stats.occupied;
+    stats.occupied_since = fork.stats.occupied_since + time;
+    stats.peak_occupied = std::max(stats.peak_occupied, fork.stats.peak_occupied);
 
-            // Log system status
-            system_status += "time: " + std::to_string(current_time) + "; current trace: " + trace_file[i] + "\n";
-            system_status += print_PCB(current, wait_queue) + "\n";
+    // (every process the branch forked has ended, none of its PIDs is in the partition table)
+    sim.memory = std::move(branch->sim.memory);
+    sim.next_pid = fork.next_pid + pid_shift;
+    const int start = time;
+    time += branch->end_time;
 
-            // d. Return from ISR
-            execution += std::to_string(current_time) + ", 1, IRET\n";
+    if (self != nullptr)
+    {
+        self->merged.push_back({std::move(branch), events.size(), sim.spans.size(), start, pid_shift, frames.back().fixed_start});
+        return true;
+    }
 
-            ///////////////////////////////////////////////////////////////////////////////////////////
+    // The delays are drawn now that they are known to be the next ones
+    replay_view view = {nullptr, *branch, events, start, 0, pid_shift, branch->pid_base, static_cast<uint32_t>(branch->known_names),
+                        std::vector<uint32_t>(branch->events.names.size(), NO_NAME)};
+    replay_branch(view, sim.rng);
+    return true;
+}
 
-            // The following loop helps you do 2 things:
-            //  * Collect the trace of the child (and only the child, skip parent)
-            //  * Get the index of where the parent is supposed to start executing from
-            std::vector<std::string> child_trace;
-            bool skip = true;
-            int parent_index = -1;
-            int endif_index = -1;
+// --paging on: the instruction at 'pc' (of the 'count' of its trace, spread evenly over the pages of
+// the process) is about to run. If its page is not in memory, the page fault handler loads it.
+// Returns the time after the fault.
+int run_page(simulator &sim, event_log &events, const PCB &process, const frame &running, std::size_t pc, std::size_t count, int time)
+{
+    const unsigned int page = pc * sim.pages.tables[process.PID].size() / count;
+    bool replaced = false;
+    if (touch_page(sim.pages, process.PID, page, replaced))
+    {
+        return time;
+    }
 
-            for (size_t j = i + 1; j < trace_file.size(); j++)
-            {
-                auto [_activity, _duration, _pn] = parse_trace(trace_file[j]);
+    sim.stats.page_faults++;
+    sim.stats.page_replacements += replaced;
+    // (the last page of a program may not fill its frame)
+    const unsigned int loaded = std::min(sim.pages.frame_size, process.size - std::min(process.size, page * sim.pages.frame_size));
+    isr_call call = {process.PID, static_cast<int>(page), loaded, 0, running.start_time, running.fixed_start};
+    return run_isr_steps(sim.context.isr.page_fault, call, time, sim, events, [](int) {});
+}
 
-                if (_activity == "IF_CHILD")
-                {
-                    skip = false; // Start collecting for child
-                    continue;
-                }
-                else if (_activity == "IF_PARENT")
-                {
-                    skip = true;      // Stop collecting for child
-                    parent_index = j; // Parent resumes here
-                    continue;         // Don't add IF_PARENT to any trace
-                }
-                else if (_activity == "ENDIF")
-                {
-                    skip = false; // Start collecting post-endif block
-                    endif_index = j;
-                    if (parent_index == -1)
-                    { // Case where there's no IF_PARENT
-                        parent_index = j;
-                    }
-                    continue; // Don't add ENDIF to child trace yet
-                }
+// Runs the top frames until 'frames' is down to stop_depth, from current_time; the inner loop of
+// simulate_trace (and of a speculative branch). Returns the time it stopped at.
+int run_frames(const compiled_trace &init_trace, simulator &sim, event_log &events, std::vector<PCB> &processes, std::vector<frame> &frames,
+               int current_time, std::size_t stop_depth, std::size_t &last_line, trace_reader *stream, fork_branch *self)
+{
+    const simulation_context &context = sim.context;
+    const program_registry &programs = context.programs;
+    const isr_table &handlers = context.isr;
+    auto no_snapshot = [](int) {};
+
+    unsigned int until_checkpoint = context.checkpoint_interval;
+    std::vector<std::unique_ptr<fork_branch>> parents;           //!< --parallel-forks: the branches running, deepest last
+    std::vector<std::shared_ptr<const waiting_process>> waiting; //!< ... the node of the frames below the top, once a branch needed it
+    const std::size_t levels_below = self != nullptr ? self->levels_below : 0; //!< processes waiting below 'frames' (in a branch)
+
+    // run each (pre-decoded) instruction of the top frame's trace
+    while (frames.size() > stop_depth)
+    {
+        if (self != nullptr && self->cancelled.load(std::memory_order_relaxed))
+        {
+            break; // nobody will merge this branch
+        }
+        if (sim.checkpoints != nullptr && --until_checkpoint == 0)
+        {
+            save_checkpoint(sim, events, current_time, last_line, processes, frames);
+            until_checkpoint = context.checkpoint_interval;
+        }
 
-                if (!skip)
-                { // If we are in child block OR post-endif block
-                    child_trace.push_back(trace_file[j]);
-                }
-            }
+        frame &top = frames.back();
+        PCB &current = processes[top.process];
+        const compiled_trace &trace_file = *top.trace;
+        const bool streamed = stream != nullptr && top.trace == &init_trace;
+        const std::size_t trace_size = streamed ? stream->instructions.count : trace_file.instructions.size();
+        auto block_of = [&](unsigned int block) -> const fork_block &
+        { return streamed ? stream->forks[block] : trace_file.forks[block]; };
 
-            // Set the parent's starting point in the outer loop
-            if (parent_index != -1)
+        if (top.pc >= trace_size)
+        {
+            // The current PCB is the one that just finished execution, so we free its memory
+            if (current.partition_number != -1)
             {
-                i = parent_index; // Parent will resume at IF_PARENT
+                events.add_partition(event_kind::PARTITION_FREED, current_time, current);
+                free_memory(sim.memory, &current);
+                sim.track_occupancy(current_time);
             }
-            else if (endif_index != -1)
+            if (context.paging)
             {
-                i = endif_index; // Or at ENDIF if no IF_PARENT
+                unmap_process(sim.pages, current.PID);
             }
-            // If neither was found, 'i' just increments, and parent runs from the next line
 
-            ///////////////////////////////////////////////////////////////////////////////////////////
-            // With the child's trace, run the child (HINT: think recursion)
+            sim.finish_times.emplace_back(current.PID, current_time);
 
-            // Save parent PCB, most recent one pushed to the wait queue
-            PCB parent_pcb = wait_queue.back();
+            // Resume the parent (if any), which is waiting in the frame below
+            frames.pop_back();
+            processes.pop_back();
 
-            // Run child recursively
-            auto [child_execution, child_status, child_final_time] = simulate_trace(child_trace, current_time, vectors, delays, external_files, current, wait_queue);
+            // ... unless its code already ran on another thread
+            while (!parents.empty() && parents.back()->depth == frames.size())
+            {
+                std::unique_ptr<fork_branch> parent = std::move(parents.back());
+                parents.pop_back();
+                if (!merge_branch(std::move(parent), sim, events, frames, current_time, self))
+                {
+                    break; // the parent runs here
+                }
+                frames.pop_back();
+                processes.pop_back();
+            }
+            // (the process on top may change from now on: its node goes)
+            waiting.resize(std::min(waiting.size(), frames.empty() ? 0 : frames.size() - 1));
+            continue;
+        }
 
-            // Update exectuion and system status logs
-            execution += child_execution;
-            system_status += child_status;
-            current_time = child_final_time;
+        // (with --stream on, the reference is good until the next instruction is read)
+        const instruction &trace = streamed ? stream->instructions[top.pc++] : trace_file.instructions[top.pc++];
+        const unsigned int pid = current.PID; // the events of this instruction belong to the current process
+        sim.stats.count(trace.op);
+        if (&trace_file == &init_trace)
+        {
+            last_line = std::max(last_line, top.pc);
+        }
+        const int duration_intr = trace.operand;
 
-            // Resume parent process
-            wait_queue.pop_back();
-            current = parent_pcb;
+        if (context.paging)
+        {
+            current_time = run_page(sim, events, current, top, top.pc - 1, trace_size, current_time);
+        }
 
-            ///////////////////////////////////////////////////////////////////////////////////////////
+        if (trace.op == opcode::CPU)
+        { // As per Assignment 1
+            events.add(current_time, duration_intr, event_kind::CPU_BURST, pid);
+            current_time += duration_intr;
+        }
+        else if (trace.op == opcode::SYSCALL || trace.op == opcode::END_IO || trace.op == opcode::INTERRUPT)
+        {
+            // The whole handler is its list of steps
+            current_time = run_isr_steps(handlers.of(trace).entry, {pid, duration_intr, 0, 0, top.start_time, top.fixed_start}, current_time, sim, events, no_snapshot);
         }
-        else if (activity == "EXEC")
+        else if (trace.op == opcode::FORK)
         {
-            auto [intr, time] = intr_boilerplate(current_time, 3, 10, vectors);
-            current_time = time;
-            execution += intr;
+            const isr_handler &handler = handlers.of(trace);
+            isr_call call = {pid, duration_intr, 0, 0, top.start_time, top.fixed_start};
+
+            // Interrupt boilerplate, then a. and b. clone the PCB of the parent process
+            current_time = run_isr_steps(handler.entry, call, current_time, sim, events, no_snapshot);
+
+            // Create the child PCB
+            PCB child_process = current;
+            child_process.PID = sim.next_pid;
+            sim.next_pid += 1;
+
+            child_process.partition_number = -1;
+            if (!context.paging && !allocate_memory(sim.memory, &child_process))
+            {
+                // Log failure and IRET
+                sim.stats.fork_failed++;
+                current_time = run_isr_steps(handler.failure, call, current_time, sim, events, no_snapshot);
+
+                // Skip the child block: resume at the parent's code (IF_PARENT block, or after ENDIF)
+                top.pc = block_of(trace.block).parent_begin;
 
-            ///////////////////////////////////////////////////////////////////////////////////////////
-            // Add your EXEC output here
+                continue;
+            }
 
-            // e. Execute the syscall from Assignment 1 (intr_boilerplate)
+            // The branch table (built when the trace was compiled) tells us where the child starts
+            // and where the parent resumes. The child runs over the same trace: its block, then the
+            // code after ENDIF (the IF_PARENT marker makes it jump there).
+            const fork_block &branches = block_of(trace.block);
+
+            // The parent waits in its frame (resuming at its IF_PARENT block, or after ENDIF) and the
+            // child PCB gets a new frame on top of it, as the current running process.
+            // ('top' and 'current' must not be used past this point: the stacks may have moved)
+            top.pc = branches.parent_begin;
+            processes.push_back(child_process);
+            frames.push_back({&trace_file, branches.child_begin, static_cast<unsigned int>(processes.size() - 1), 0});
+
+            sim.stats.fork_success++;
+            sim.stats.max_depth = std::max(sim.stats.max_depth, levels_below + frames.size());
+            sim.stats.max_wait_queue = std::max(sim.stats.max_wait_queue, levels_below + frames.size() - 1);
+            sim.track_occupancy(current_time);
+            if (context.paging)
+                map_process(sim.pages, child_process.PID, child_process.size);
+            else
+                events.add_partition(event_kind::PARTITION_TAKEN, current_time, child_process);
+
+            // c. Scheduler call, log system status, d. return from ISR
+            current_time = run_isr_steps(handler.success, call, current_time, sim, events, [&](int time)
+                                         { record_PCB(events, time, trace, processes, frames, programs, self != nullptr ? self->below.get() : nullptr); });
+
+            // The child runs from here (its frame is on top); the parent continues when it is popped,
+            // or from now on on another thread if it has enough left to do
+            frames.back().start_time = current_time;
+            if (sim.pool != nullptr && trace_size - branches.parent_begin >= PARALLEL_FORK_MIN &&
+                (!events.recording || !events.names.empty()) && (self == nullptr || self->nesting + 1 < PARALLEL_FORK_MAX_NESTING) &&
+                sim.pool->take_branch())
+            {
+                parents.push_back(spawn_branch(init_trace, sim, events, processes, frames, waiting, self));
+            }
+        }
+        else if (trace.op == opcode::IF_PARENT && trace.block != NO_BLOCK)
+        {
+            // Only a child gets here (the parent resumes past this marker): skip the parent block
+            top.pc = block_of(trace.block).post_begin;
+        }
+        else if (trace.op == opcode::EXEC)
+        {
+            const isr_handler &handler = handlers.of(trace);
+            const program_image &program = programs.images[trace.program];
+            isr_call call = {pid, duration_intr, program.size, 0, top.start_time, top.fixed_start};
+            auto snapshot = [&](int time)
+            { record_PCB(events, time, trace, processes, frames, programs, self != nullptr ? self->below.get() : nullptr); };
+            const int exec_time = current_time;
 
             // Free current process memory (as exec overwrites the process)
             if (current.partition_number != -1)
             {
-                // free_memory() must be implemented to set the partition code to "free" and PCB partition to -1
-                free_memory(&current);
+                events.add_partition(event_kind::PARTITION_FREED, current_time, current);
+                free_memory(sim.memory, &current);
+                sim.track_occupancy(current_time);
             }
 
-            // f. Search file in file list and obtain memory size
-            unsigned int new_program_size = get_size(program_name, external_files);
-            // The duration_intr from the trace file is used for the time taken to search the file (e.g., 50ms)
-            execution += std::to_string(current_time) + ", " + std::to_string(duration_intr) + ", Program is " + std::to_string(new_program_size) + " Mb large\n";
-            current_time += duration_intr;
+            // Interrupt boilerplate, then f. search the file in the file list and obtain its memory
+            // size (the duration from the trace file is the time taken to search the file)
+            current_time = run_isr_steps(handler.entry, call, current_time, sim, events, snapshot);
 
             // g. Find an empty partition where the executable fits
-            // Update PCB info needed for allocation
-            current.program_name = program_name;
-            current.size = new_program_size;
+            current.program = trace.program;
+            current.size = program.size;
             current.partition_number = -1; // Reset partition before allocation
 
-            // Find partition and update current.partition_number
-            if (!allocate_memory(&current))
+            if (context.paging)
+            {
+                // with paging, nothing is loaded yet: the pages are loaded as they are run
+                map_process(sim.pages, current.PID, current.size);
+            }
+            else if (!allocate_memory(sim.memory, &current))
+            {
+                sim.stats.exec_failed++;
+                call.name = events.intern(programs, trace.program);
+                current_time = run_isr_steps(handler.failure, call, current_time, sim, events, snapshot);
+                top.pc = trace_size; // the process ends
+                continue;
+            }
+
+            sim.stats.exec_success++;
+            sim.track_occupancy(current_time);
+            if (!context.paging)
+            {
+                events.add_partition(event_kind::PARTITION_TAKEN, current_time, current);
+            }
+
+            // h. to k. load the program (or set up its page table), mark the partition, update the
+            // PCB, call the scheduler and return from the ISR, then log the system status
+            current_time = run_isr_steps(context.paging ? handler.paged : handler.success, call, current_time, sim, events, snapshot);
+
+            // l. Run the new program (loaded and compiled once, when the simulation started).
+            // EXEC replaces the process image and nothing after it in the old trace runs, so the
+            // program simply takes over this frame instead of nesting a new one.
+            top.trace = &program.trace;
+            top.pc = 0;
+            top.start_time = current_time;
+            top.fixed_start = false;
+
+            // The program starts: with paging, once its first page is loaded
+            if (!program.trace.instructions.empty())
             {
-                execution += std::to_string(current_time) + ", 0, EXEC failed: Memory allocation failed for " + program_name + "\n";
-                system_status += "time: " + std::to_string(current_time) + "; current trace: " + trace_file[i] + "\n";
-                system_status += print_PCB(current, wait_queue) + "\n";
-                return {execution, system_status, current_time};
+                if (context.paging)
+                {
+                    current_time = run_page(sim, events, current, top, 0, program.trace.instructions.size(), current_time);
+                }
+                sim.stats.exec_latency(current_time - exec_time);
             }
+        }
+    }
 
-            // h. Simulate the execution of the loader
-            int loader_time = new_program_size * 15; // 15ms for every Mb of program
-            execution += std::to_string(current_time) + ", " + std::to_string(loader_time) + ", loading program into memory\n";
-            current_time += loader_time;
+    return current_time;
+}
 
-            // i. Mark partition as occupied (3ms from sample log)
-            int marking_time = 3;
-            execution += std::to_string(current_time) + ", " + std::to_string(marking_time) + ", marking partition as occupied\n";
-            current_time += marking_time;
+// Runs a trace as process 'init', recording what happens into the event log.
+// FORK and EXEC do not recurse: the simulation loops over an explicit, heap-allocated stack of
+// frames, so the nesting depth is only limited by memory.
+// With 'resume', the run goes on from a checkpoint instead (the simulator must be restored to it).
+// Returns the time at which the last process finished.
+int simulate_trace(const compiled_trace &init_trace, int start_time, simulator &sim, PCB init, event_log &events, const checkpoint *resume = nullptr)
+{
+    // With --stream on, the trace file is read from its spilled copy instead of init_trace
+    std::optional<trace_reader> stream;
+    if (sim.context.stream && &init_trace == &sim.context.trace)
+    {
+        stream.emplace(sim.context.spilled);
+    }
 
-            // j. Update PCB (6ms from sample log)
-            int update_time = 6;
-            execution += std::to_string(current_time) + ", " + std::to_string(update_time) + ", updating PCB\n";
-            current_time += update_time;
+    std::vector<PCB> processes; //!< process table, frames[k] runs processes[frames[k].process]
+    std::vector<frame> frames;  //!< frames below the top are parents waiting for a child (the wait queue)
 
-            // k. Scheduler call
-            execution += std::to_string(current_time) + ", 0, scheduler called\n";
+    int current_time = start_time;
+    std::size_t last_line = 0; //!< every line of init_trace run so far is below it
 
-            // k. Return from ISR
-            execution += std::to_string(current_time) + ", 1, IRET\n";
-            current_time += 1;
+    if (resume != nullptr)
+    {
+        processes = resume->processes;
+        frames = resume->frames;
+        current_time = resume->time;
+        last_line = resume->last_line;
+    }
+    else
+    {
+        processes.push_back(init);
+        frames.push_back({&init_trace, 0, 0, start_time});
+    }
 
-            // Log system status
-            system_status += "time: " + std::to_string(current_time) + "; current trace: " + trace_file[i] + "\n";
-            system_status += print_PCB(current, wait_queue) + "\n";
+    return run_frames(init_trace, sim, events, processes, frames, current_time, 0, last_line, stream ? &*stream : nullptr);
+}
 
-            ///////////////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Scheduling mode (--cpus N): every process (the trace and each forked child) is scheduled on N
+// simulated cores from a ready queue, instead of the child running to completion while its
+// parent waits. Instructions cost the same as in simulate_trace; the execution log gets one line
+// per unit of work, tagged with its core and PID. Processes whose FORK/EXEC cannot get memory
+// (while another process holds a partition) wait in the wait queue until a partition is freed.
+// With --io async, the engine is driven by a time-ordered queue of core and device events: a
+// SYSCALL only costs its ISR on the core and blocks the process, the device serves its requests
+// in order and raises a completion interrupt that makes the process ready again, while the other
+// processes keep the cores busy.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define NO_PROCESS -1
+#define IDLE_CORE 2147483647 //!< free_at of a core with nothing to run
+
+// A process of the scheduling mode
+struct sched_process
+{
+    PCB pcb;
+    const compiled_trace *trace; // the trace being run (the trace file or a program image)
+    std::size_t pc;              // index of the next instruction
+    int remaining;               // what is left of a preempted CPU burst (0 if none)
+    int priority;                // lower value runs first (PRIORITY policy)
+    bool fail_alloc;             // set to break a memory deadlock: the next allocation fails
+
+    int arrival;       // time the process was created
+    int first_run;     // time it was first dispatched (-1 before)
+    int finish;        // time it ended (-1 before)
+    int ready_since;   // time it last entered the ready queue
+    long long waiting; // total time spent in the ready queue
+    long long cpu;     // total time spent on a core
+    long long io;      // total time blocked on a device (async I/O)
+    std::size_t depth; // FORK nesting level (init is at depth 1)
+    int device;        // device of the pending I/O request (async I/O)
+};
+
+// What happens to the process of a core when its current unit of work ends
+enum class unit_outcome
+{
+    CONTINUE,
+    BLOCK, // waits for memory
+    IO,    // waits for a device (async I/O)
+    EXIT
+};
+
+// A simulated core
+struct sched_core
+{
+    int process = NO_PROCESS;                   // index of the running process
+    int free_at = 0;                            // time at which the current unit of work ends
+    int slice = 0;                              // time used by the process in its current quantum
+    long long busy = 0;                         // total time spent running processes
+    unit_outcome outcome = unit_outcome::CONTINUE;
+    int spawned = NO_PROCESS;                   // child created by the unit, made ready when it ends
+    const instruction *status = nullptr;        // FORK/EXEC whose system status is logged when the unit ends
+};
+
+// Runs the trace on context.cpus cores under context.policy. Returns the time the last process ended.
+int schedule_trace(simulator &sim, PCB init, event_log &events, output_sink &metrics)
+{
+    const simulation_context &context = sim.context;
+    const program_registry &programs = context.programs;
+    const bool round_robin = context.policy == schedule_policy::ROUND_ROBIN;
+    const bool by_priority = context.policy == schedule_policy::PRIORITY;
 
-            // l. Run the new program
-            std::ifstream exec_trace_file(program_name + ".txt");
+    unsigned int largest_partition = 0;
+    for (const auto &partition : sim.memory.partitions)
+    {
+        largest_partition = std::max(largest_partition, partition.size);
+    }
 
-            std::vector<std::string> exec_traces;
-            std::string exec_trace;
-            while (std::getline(exec_trace_file, exec_trace))
-            {
-                exec_traces.push_back(exec_trace);
-            }
+    std::vector<sched_process> processes; //!< every process created, in creation order
+    std::vector<sched_core> cores(context.cpus);
 
-            ///////////////////////////////////////////////////////////////////////////////////////////
-            // With the exec's trace (i.e. trace of external program), run the exec (HINT: think recursion)
+    // Ready queue ordered by (priority, arrival in the queue); the priority is 0 unless the
+    // policy is PRIORITY, which makes it a FIFO. Kept separate from the wait queue.
+    std::set<std::tuple<int, unsigned long, int>> ready_queue;
+    unsigned long ready_seq = 0;
+    std::deque<int> wait_queue; //!< processes waiting for a partition, FIFO
 
-            auto [sub_execution, sub_system_status, new_time] = simulate_trace(exec_traces, current_time, vectors, delays, external_files, current, wait_queue);
+    // Async I/O: pending device completions, ordered by (time, request order), and the time each
+    // device is done with the requests it was given
+    std::set<std::tuple<int, unsigned long, int, int>> completions; // (time, order, process, device)
+    unsigned long request_seq = 0;
+    std::vector<int> device_free(context.delays.size(), 0);
+    std::vector<long long> device_busy(context.delays.size(), 0);
 
-            execution += sub_execution;
-            system_status += sub_system_status;
-            current_time = new_time;
+    int last_time = 0;
 
-            ///////////////////////////////////////////////////////////////////////////////////////////
+    auto make_ready = [&](int index, int time)
+    {
+        sched_process &process = processes[index];
+        process.ready_since = time;
+        ready_queue.emplace(by_priority ? process.priority : 0, ready_seq++, index);
 
-            break; // Why is this important? (answer in report)
+        // wake up an idle core
+        for (auto &core : cores)
+        {
+            if (core.process == NO_PROCESS && core.free_at == IDLE_CORE)
+            {
+                core.free_at = time;
+                break;
+            }
         }
-    }
+    };
 
-    // The current PCB is the one that just finished execution, so we free its memory
-    if (current.partition_number != -1)
+    auto wake_waiting = [&](int time)
     {
-        free_memory(&current);
-    }
+        while (!wait_queue.empty())
+        {
+            make_ready(wait_queue.front(), time);
+            wait_queue.pop_front();
+        }
+    };
 
-    return {execution, system_status, current_time};
-}
+    auto release_memory = [&](sched_process &process, int time)
+    {
+        if (process.pcb.partition_number != -1)
+        {
+            events.add_partition(event_kind::PARTITION_FREED, time, process.pcb);
+            free_memory(sim.memory, &process.pcb);
+            sim.track_occupancy(time);
+            wake_waiting(time);
+        }
+    };
 
-int main(int argc, char **argv)
-{
+    // Allocation failures wait for memory only if another process may still free a partition
+    auto should_wait = [&](sched_process &process, unsigned int size)
+    {
+        int others = static_cast<int>(sim.memory.occupied) - (process.pcb.partition_number != -1 ? 1 : 0);
+        if (process.fail_alloc || size > largest_partition || others == 0)
+        {
+            process.fail_alloc = false;
+            return false;
+        }
+        return true;
+    };
 
-    // vectors is a C++ std::vector of strings that contain the address of the ISR
-    // delays  is a C++ std::vector of ints that contain the delays of each device
-    // the index of these elemens is the device number, starting from 0
-    // external_files is a C++ std::vector of the struct 'external_file'. Check the struct in
-    // interrupt.hpp to know more.
-    auto [vectors, delays, external_files] = parse_args(argc, argv);
-    std::ifstream input_file(argv[1]);
+    auto log = [&](int time, int duration, std::size_t core, const sched_process &process, event_kind kind, int number = 0, int partition = -1, uint32_t name = 0)
+    {
+        events.add(time, duration, kind, process.pcb.PID, number, partition, name, core);
+    };
 
-    // Just a sanity check to know what files you have
-    print_external_files(external_files);
+    // Time the handler of a SYSCALL/END_IO/interrupt line takes, as charged by simulate_trace
+    auto handler_cost = [&](const instruction &trace)
+    {
+        const isr_handler &handler = context.isr.of(trace);
+        return isr_cost(handler.entry, trace.operand, 0, handler.uses_delay ? sim.delays[trace.operand] : 0);
+    };
 
-    // Make initial PCB (notice how partition is not assigned yet)
-    PCB current(0, -1, "init", 1, -1);
-    // Update memory (partition is assigned here, you must implement this function)
-    if (!allocate_memory(&current))
+    auto log_status = [&](int time, const sched_process &process, const instruction &trace)
     {
-        std::cerr << "ERROR! Memory allocation failed!" << std::endl;
-    }
+        if (!events.recording)
+        {
+            return;
+        }
 
-    std::vector<PCB> wait_queue;
+        if (trace.op == opcode::EXEC)
+            events.add(time, 0, event_kind::STATUS_EXEC, process.pcb.PID, trace.operand, -1, events.intern(programs, trace.program));
+        else
+            events.add(time, 0, event_kind::STATUS_FORK, process.pcb.PID, trace.operand);
 
-    /******************ADD YOUR VARIABLES HERE*************************/
+        for (const auto &core : cores)
+        {
+            if (core.process != NO_PROCESS)
+            {
+                events.add_row(event_kind::ROW_RUNNING, time, processes[core.process].pcb, programs);
+            }
+        }
+        for (const auto &[priority, seq, index] : ready_queue)
+        {
+            events.add_row(event_kind::ROW_READY, time, processes[index].pcb, programs);
+        }
+        for (int index : wait_queue)
+        {
+            events.add_row(event_kind::ROW_WAITING, time, processes[index].pcb, programs);
+        }
+    };
 
-    /******************************************************************/
+    // Follows the IF_CHILD/IF_PARENT/ENDIF markers, which take no time. Returns false at the end of the trace.
+    auto next_instruction = [&](sched_process &process)
+    {
+        const compiled_trace &trace_file = *process.trace;
+        while (process.pc < trace_file.instructions.size())
+        {
+            const instruction &trace = trace_file.instructions[process.pc];
+            if (trace.op == opcode::IF_PARENT && trace.block != NO_BLOCK)
+            {
+                sim.stats.count(trace.op);
+                process.pc = trace_file.forks[trace.block].post_begin; // a child skips the parent block
+            }
+            else if (trace.op == opcode::IF_CHILD || trace.op == opcode::IF_PARENT || trace.op == opcode::ENDIF)
+            {
+                sim.stats.count(trace.op);
+                process.pc++;
+            }
+            else
+            {
+                return true;
+            }
+        }
+        return false;
+    };
 
-    // Converting the trace file into a vector of strings.
-    std::vector<std::string> trace_file;
-    std::string trace;
-    while (std::getline(input_file, trace))
+    // Runs the next unit of work of a core's process at 'time', returns its duration
+    auto run_unit = [&](std::size_t core_index, int time) -> int
     {
-        trace_file.push_back(trace);
-    }
+        sched_core &core = cores[core_index];
+        sched_process &process = processes[core.process];
+        core.outcome = unit_outcome::CONTINUE;
 
-    auto [execution, system_status, _] = simulate_trace(trace_file,
-                                                        0,
-                                                        vectors,
-                                                        delays,
-                                                        external_files,
-                                                        current,
-                                                        wait_queue);
+        if (!next_instruction(process))
+        {
+            core.outcome = unit_outcome::EXIT;
+            return 0;
+        }
 
-    input_file.close();
+        const compiled_trace &trace_file = *process.trace;
+        const instruction &trace = trace_file.instructions[process.pc];
+        int duration = 0;
 
-    write_output(execution, "execution.txt");
-    write_output(system_status, "system_status.txt");
+        if (trace.op == opcode::CPU)
+        {
+            duration = process.remaining > 0 ? process.remaining : trace.operand;
+            if (round_robin && duration > context.quantum - core.slice)
+            {
+                duration = std::max(context.quantum - core.slice, 1);
+                process.remaining = (process.remaining > 0 ? process.remaining : trace.operand) - duration;
+            }
+            else
+            {
+                sim.stats.count(trace.op); // the whole burst has run
+                process.remaining = 0;
+                process.pc++;
+            }
+            log(time, duration, core_index, process, event_kind::CORE_CPU_BURST);
+        }
+        else if (trace.op == opcode::SYSCALL && context.async_io)
+        {
+            duration = isr_cost(context.isr.of(trace).entry, trace.operand, 0, 0); // the device takes the delay
+            sim.stats.count(trace.op);
+            process.pc++;
+            process.device = trace.operand;
+            core.outcome = unit_outcome::IO;
+            log(time, duration, core_index, process, event_kind::CORE_IO_STARTED, trace.operand);
+        }
+        else if (trace.op == opcode::SYSCALL)
+        {
+            duration = handler_cost(trace);
+            sim.stats.count(trace.op);
+            process.pc++;
+            log(time, duration, core_index, process, event_kind::CORE_SYSCALL, trace.operand);
+        }
+        else if (trace.op == opcode::END_IO)
+        {
+            // With async I/O the device already took the delay while the process waited
+            duration = context.async_io ? isr_cost(context.isr.of(trace).entry, trace.operand, 0, 0) : handler_cost(trace);
+            sim.stats.count(trace.op);
+            process.pc++;
+            log(time, duration, core_index, process, event_kind::CORE_END_IO, trace.operand);
+        }
+        else if (trace.op == opcode::INTERRUPT)
+        {
+            duration = handler_cost(trace);
+            sim.stats.count(trace.op);
+            process.pc++;
+            log(time, duration, core_index, process, event_kind::CORE_INTERRUPT, trace.operand, -1, events.intern(context.isr.of(trace).name));
+        }
+        else if (trace.op == opcode::FORK)
+        {
+            const isr_handler &handler = context.isr.of(trace);
+            duration = isr_cost(handler.entry, trace.operand, 0, 0) + isr_cost(handler.success, trace.operand, 0, 0);
+            const fork_block &branches = trace_file.forks[trace.block];
 
-    return 0;
-}
+            PCB child = process.pcb;
+            child.PID = sim.next_pid;
+            child.partition_number = -1;
+
+            if (!allocate_memory(sim.memory, &child))
+            {
+                if (should_wait(process, child.size))
+                {
+                    sim.stats.memory_waits++;
+                    core.outcome = unit_outcome::BLOCK; // retries the FORK once memory is freed
+                    log(time, duration, core_index, process, event_kind::CORE_FORK_WAITING);
+                    return duration;
+                }
+
+                sim.stats.count(trace.op);
+                sim.stats.fork_failed++;
+                process.pc = branches.parent_begin; // skip the child block
+                log(time, duration, core_index, process, event_kind::CORE_FORK_FAILED);
+                return duration;
+            }
+
+            sim.next_pid += 1;
+            sim.stats.count(trace.op);
+            sim.stats.fork_success++;
+            sim.stats.max_depth = std::max(sim.stats.max_depth, process.depth + 1);
+            sim.track_occupancy(time);
+            events.add_partition(event_kind::PARTITION_TAKEN, time, child);
+            process.pc = branches.parent_begin;
+
+            processes.push_back({child, &trace_file, branches.child_begin, 0, process.priority, false, time + duration, -1, -1, 0, 0, 0, 0, process.depth + 1, -1});
+            core.spawned = processes.size() - 1;
+
+            // 'process' may have moved with the push_back
+            log(time, duration, core_index, processes[core.process], event_kind::CORE_FORK, child.PID);
+            core.status = &trace;
+        }
+        else if (trace.op == opcode::EXEC)
+        {
+            const program_image &program = programs.images[trace.program];
+            const isr_handler &handler = context.isr.of(trace);
+            duration = isr_cost(handler.entry, trace.operand, 0, 0);
+
+            release_memory(process, time); // EXEC overwrites the process
+
+            process.pcb.program = trace.program;
+            process.pcb.size = program.size;
+            if (!allocate_memory(sim.memory, &process.pcb))
+            {
+                if (should_wait(process, program.size))
+                {
+                    sim.stats.memory_waits++;
+                    core.outcome = unit_outcome::BLOCK;
+                    log(time, duration, core_index, process, event_kind::CORE_EXEC_WAITING, 0, -1, events.intern(programs, trace.program));
+                    return duration;
+                }
+
+                sim.stats.count(trace.op);
+                sim.stats.exec_failed++;
+                core.outcome = unit_outcome::EXIT;
+                log(time, duration, core_index, process, event_kind::CORE_EXEC_FAILED, 0, -1, events.intern(programs, trace.program));
+                core.status = &trace;
+                return duration;
+            }
+
+            sim.stats.count(trace.op);
+            sim.stats.exec_success++;
+            sim.track_occupancy(time);
+            events.add_partition(event_kind::PARTITION_TAKEN, time, process.pcb);
+            duration += isr_cost(handler.success, trace.operand, program.size, 0);
+            process.trace = &program.trace;
+            process.pc = 0;
+            process.remaining = 0;
+            process.priority = program.priority;
+            log(time, duration, core_index, process, event_kind::CORE_EXEC, 0, process.pcb.partition_number, events.intern(programs, trace.program));
+            core.status = &trace;
+        }
+
+        if (core.outcome == unit_outcome::CONTINUE && !next_instruction(processes[core.process]))
+        {
+            core.outcome = unit_outcome::EXIT;
+        }
+        return duration;
+    };
+
+    processes.push_back({init, &context.trace, 0, 0, 0, false, 0, -1, -1, 0, 0, 0, 0, 1, -1});
+    for (auto &core : cores)
+    {
+        core.free_at = IDLE_CORE;
+    }
+    make_ready(0, 0);
+
+    while (true)
+    {
+        // the next core to act is the one whose unit of work ends first
+        std::size_t core_index = 0;
+        for (std::size_t k = 1; k < cores.size(); k++)
+        {
+            if (cores[k].free_at < cores[core_index].free_at)
+            {
+                core_index = k;
+            }
+        }
+
+        // A device completion comes first: the process it wakes up may be dispatched at that time
+        if (!completions.empty() && std::get<0>(*completions.begin()) <= cores[core_index].free_at)
+        {
+            const auto [time, order, index, device] = *completions.begin();
+            completions.erase(completions.begin());
+
+            sched_process &process = processes[index];
+            process.io += time - process.ready_since;
+            log(time, 0, 0, process, event_kind::CORE_IO_DONE, device);
+            make_ready(index, time);
+            continue;
+        }
+
+        sched_core &core = cores[core_index];
+        if (core.free_at == IDLE_CORE)
+        {
+            if (wait_queue.empty())
+            {
+                break; // every process has ended
+            }
+
+            // Every process left is waiting for memory that nobody will free: the oldest one fails
+            processes[wait_queue.front()].fail_alloc = true;
+            make_ready(wait_queue.front(), last_time);
+            wait_queue.pop_front();
+            continue;
+        }
+
+        const int time = core.free_at;
+        last_time = time;
+
+        // End of the unit of work of the running process
+        if (core.process != NO_PROCESS)
+        {
+            sched_process &process = processes[core.process];
+
+            if (core.spawned != NO_PROCESS)
+            {
+                make_ready(core.spawned, time);
+                core.spawned = NO_PROCESS;
+            }
+
+            if (core.status != nullptr)
+            {
+                log_status(time, process, *core.status);
+                core.status = nullptr;
+            }
+
+            if (core.outcome == unit_outcome::EXIT)
+            {
+                process.finish = time;
+                sim.finish_times.emplace_back(process.pcb.PID, time);
+                release_memory(process, time);
+                log(time, 0, core_index, process, event_kind::CORE_TERMINATED);
+                core.process = NO_PROCESS;
+            }
+            else if (core.outcome == unit_outcome::IO)
+            {
+                // the device starts the request once it is done with the earlier ones
+                const int delay = sim.delays[process.device];
+                const int start = std::max(time, device_free[process.device]);
+                device_free[process.device] = start + delay;
+                device_busy[process.device] += delay;
+                completions.emplace(start + delay, request_seq++, core.process, process.device);
+                process.ready_since = time; // start of the I/O wait
+                core.process = NO_PROCESS;
+            }
+            else if (core.outcome == unit_outcome::BLOCK)
+            {
+                wait_queue.push_back(core.process);
+                sim.stats.max_wait_queue = std::max(sim.stats.max_wait_queue, wait_queue.size());
+                core.process = NO_PROCESS;
+            }
+            else if (!ready_queue.empty() &&
+                     ((round_robin && core.slice >= context.quantum) ||
+                      (by_priority && std::get<0>(*ready_queue.begin()) < process.priority)))
+            {
+                log(time, 0, core_index, process, event_kind::CORE_PREEMPTED);
+                int index = core.process;
+                core.process = NO_PROCESS;
+                make_ready(index, time);
+            }
+            else if (round_robin && core.slice >= context.quantum)
+            {
+                core.slice = 0; // nobody else is ready: the process gets a new quantum
+            }
+        }
+
+        // Dispatch the next ready process
+        if (core.process == NO_PROCESS)
+        {
+            if (ready_queue.empty())
+            {
+                core.free_at = IDLE_CORE;
+                continue;
+            }
+
+            auto next = ready_queue.begin();
+            core.process = std::get<2>(*next);
+            core.slice = 0;
+            ready_queue.erase(next);
+
+            sched_process &process = processes[core.process];
+            process.waiting += time - process.ready_since;
+            if (process.first_run == -1)
+            {
+                process.first_run = time;
+            }
+            log(time, 0, core_index, process, event_kind::CORE_DISPATCHED);
+        }
+
+        int duration = run_unit(core_index, time);
+        core.free_at = time + duration;
+        core.slice += duration;
+        core.busy += duration;
+        processes[core.process].cpu += duration;
+    }
+
+    // Per-process turnaround and waiting time, and per-core utilization
+    long long busy = 0;
+    metrics += "  PID | program name | arrival | first run |  finish | turnaround | waiting |     cpu\n";
+    for (const auto &process : processes)
+    {
+        char row[128];
+        snprintf(row, sizeof(row), "%5u | %12s | %7d | %9d | %7d | %10d | %7lld | %7lld\n",
+                 process.pcb.PID, programs.images[process.pcb.program].name.c_str(), process.arrival, process.first_run,
+                 process.finish, process.finish - process.arrival, process.waiting, process.cpu);
+        metrics += row;
+    }
+    metrics += "\n";
+    for (std::size_t k = 0; k < cores.size(); k++)
+    {
+        busy += cores[k].busy;
+        metrics += "core " + std::to_string(k) + " utilization: " + std::to_string(last_time > 0 ? 100.0 * cores[k].busy / last_time : 0.0) + "%\n";
+    }
+    metrics += "cores: " + std::to_string(cores.size()) + "\n";
+    metrics += "processes: " + std::to_string(processes.size()) + "\n";
+    metrics += "makespan: " + std::to_string(last_time) + "\n";
+    metrics += "throughput: " + std::to_string(last_time > 0 ? 1000.0 * processes.size() / last_time : 0.0) + " processes/s\n";
+    metrics += "CPU utilization: " + std::to_string(last_time > 0 ? 100.0 * busy / (double(last_time) * cores.size()) : 0.0) + "%\n";
+    if (context.async_io)
+    {
+        long long blocked = 0;
+        for (const auto &process : processes)
+        {
+            blocked += process.io;
+        }
+        metrics += "time blocked on I/O: " + std::to_string(blocked) + "\n";
+        for (std::size_t device = 0; device < device_busy.size(); device++)
+        {
+            if (device_busy[device] > 0)
+            {
+                metrics += "device " + std::to_string(device) + " utilization: " + std::to_string(last_time > 0 ? 100.0 * device_busy[device] / last_time : 0.0) + "%\n";
+            }
+        }
+    }
+
+    return last_time;
+}
+
+// Sets the simulator back to the state it had at a checkpoint (the host timings are kept)
+void restore_checkpoint(simulator &sim, const checkpoint &state)
+{
+    restore_memory(sim.memory, state);
+    sim.next_pid = state.next_pid;
+    std::istringstream rng(state.rng);
+    rng >> sim.rng;
+    sim.finish_times = state.finish_times;
+
+    run_stats stats = state.stats;
+    stats.host_timing = sim.stats.host_timing;
+    stats.parse_seconds = sim.stats.parse_seconds;
+    sim.stats = std::move(stats);
+    sim.resumed_time = state.time;
+}
+
+// Runs sim.context from the init process (or from the checkpoint 'resume', sequential mode only),
+// recording into the event log (metrics is only written in the scheduling mode).
+// Returns the time at which the last process finished.
+int run_simulation(simulator &sim, event_log &events, output_sink &metrics, const checkpoint *resume = nullptr)
+{
+    // Make initial PCB (notice how partition is not assigned yet)
+    PCB current(0, -1, sim.context.programs.ids.at(INIT_PROGRAM), 1, -1);
+    if (resume != nullptr)
+    {
+        restore_checkpoint(sim, *resume);
+    }
+    else if (sim.context.paging)
+    {
+        map_process(sim.pages, current.PID, current.size); // its pages are loaded as they are run
+    }
+    // Update memory (partition is assigned here, you must implement this function)
+    else if (!allocate_memory(sim.memory, &current))
+    {
+        std::cerr << "ERROR! Memory allocation failed!" << std::endl;
+    }
+    else
+    {
+        events.add_partition(event_kind::PARTITION_TAKEN, 0, current);
+    }
+    sim.track_occupancy(resume != nullptr ? resume->time : 0);
+    sim.stats.max_depth = std::max<std::size_t>(sim.stats.max_depth, 1);
+
+    // the engine's time, less the time its chunks spent being rendered and written
+    run_stats &stats = sim.stats;
+    const double start = stats.host_timing ? host_clock() : 0;
+    const double drained = stats.format_seconds + stats.write_seconds;
+
+    // --parallel-forks: the branches share --jobs threads with this one
+    fork_pool pool;
+    if (sim.context.parallel_forks && sim.context.cpus == 0)
+    {
+        const unsigned int jobs = sim.context.jobs > 0 ? sim.context.jobs : std::thread::hardware_concurrency();
+        pool.idle = static_cast<int>(std::max(jobs, 1u)) - 1;
+        sim.pool = &pool;
+    }
+
+    int end_time;
+    if (sim.context.cpus > 0)
+    {
+        end_time = schedule_trace(sim, current, events, metrics);
+    }
+    else
+    {
+        end_time = simulate_trace(sim.context.trace,
+                                  0,
+                                  sim,
+                                  current,
+                                  events,
+                                  resume);
+        sim.pool = nullptr;
+    }
+
+    if (stats.host_timing)
+    {
+        stats.simulate_seconds += host_clock() - start - (stats.format_seconds + stats.write_seconds - drained);
+    }
+    sim.track_occupancy(end_time);
+
+    events.drain(); // the last events
+    return end_time;
+}
+
+// Writes the counters and host timings of a finished run as a JSON object
+void write_stats(const simulator &sim, int end_time, output_sink &output)
+{
+    const run_stats &stats = sim.stats;
+    char number[64];
+
+    output.print("{\n  \"end_time\": ", end_time, ",\n");
+    output.print("  \"cpus\": ", sim.context.cpus, ",\n");
+
+    output.print("  \"executed\": {");
+    for (std::size_t op = 0; op < OPCODE_COUNT; op++)
+    {
+        output.print(op > 0 ? ", " : "", '"', OPCODE_NAMES[op], "\": ", stats.executed[op]);
+    }
+    output.print("},\n");
+
+    output.print("  \"fork\": {\"success\": ", stats.fork_success, ", \"failed\": ", stats.fork_failed, "},\n");
+    output.print("  \"exec\": {\"success\": ", stats.exec_success, ", \"failed\": ", stats.exec_failed, "},\n");
+    output.print("  \"memory_waits\": ", stats.memory_waits, ",\n");
+    output.print("  \"max_wait_queue\": ", stats.max_wait_queue, ",\n");
+    output.print("  \"max_depth\": ", stats.max_depth, ",\n");
+    if (sim.context.parallel_forks)
+    {
+        output.print("  \"fork_branches\": {\"merged\": ", stats.branches_merged, ", \"rerun\": ", stats.branches_rerun, "},\n");
+    }
+    if (sim.context.cpus == 0)
+    {
+        snprintf(number, sizeof(number), "%.3f", stats.exec_latencies > 0 ? double(stats.exec_latency_total) / stats.exec_latencies : 0.0);
+        output.print("  \"exec_latency\": {\"count\": ", stats.exec_latencies, ", \"mean\": ", std::string_view(number),
+                     ", \"max\": ", stats.exec_latency_max, "},\n");
+    }
+    if (sim.context.paging)
+    {
+        static const char *const policies[] = {"fifo", "lru", "clock"};
+        output.print("  \"paging\": {\"frames\": ", sim.context.frame_count, ", \"frame_size\": ", sim.context.frame_size,
+                     ", \"replacement\": \"", policies[static_cast<int>(sim.context.replacement)], "\", \"faults\": ", stats.page_faults,
+                     ", \"replacements\": ", stats.page_replacements, "},\n");
+    }
+
+    // occupancy: the time spent at each level, and its time-weighted mean
+    long long total = 0, weighted = 0;
+    output.print("  \"occupancy\": {\"partitions\": ", sim.memory.partitions.size(), ", \"peak\": ", stats.peak_occupied, ", \"time_at\": [");
+    for (std::size_t level = 0; level < stats.time_at_occupancy.size(); level++)
+    {
+        output.print(level > 0 ? ", " : "", stats.time_at_occupancy[level]);
+        total += stats.time_at_occupancy[level];
+        weighted += stats.time_at_occupancy[level] * static_cast<long long>(level);
+    }
+    snprintf(number, sizeof(number), "%.3f", total > 0 ? double(weighted) / total : double(stats.occupied));
+    output.print("], \"mean\": ", std::string_view(number), "},\n");
+
+    output.print("  \"host_seconds\": {");
+    const std::pair<const char *, double> timers[] = {
+        {"parse", stats.parse_seconds}, {"simulate", stats.simulate_seconds}, {"format", stats.format_seconds}, {"write", stats.write_seconds}};
+    for (const auto &[name, seconds] : timers)
+    {
+        snprintf(number, sizeof(number), "%.6f", seconds);
+        output.print(name == timers[0].first ? "" : ", ", '"', name, "\": ", std::string_view(number));
+    }
+    output.print("}\n}\n");
+}
+
+// Closes a text log, confirming that it was written (as write_output did for each file)
+bool close_text_log(output_sink &log, bool confirm)
+{
+    if (!log.close())
+    {
+        return false;
+    }
+    if (confirm)
+    {
+        std::cout << "File content overwritten successfully." << std::endl;
+        std::cout << "Output generated in execution.txt" << std::endl;
+    }
+    return true;
+}
+
+// Runs one simulation of sim.context, writing into output_dir: execution.txt and system_status.txt
+// (unless --text off), the binary event file (--events), the snapshot store (--snapshots), the JSON summary (--stats), the
+// checkpoints (--checkpoint) and, in the scheduling mode, scheduler_metrics.txt.
+// With --resume, the run goes on from the last usable checkpoint and the text logs are cut back to it.
+// Returns the time at which the last process finished, or -1 if an output file could not be written.
+// Throws std::runtime_error if the checkpoints cannot be used.
+int run_simulation(simulator &sim, const std::string &output_dir)
+{
+    const simulation_context &context = sim.context;
+
+    // The last checkpoint that the edits of the trace file did not change. The checkpoints up to
+    // it are still valid, they are copied to the new checkpoint file.
+    std::vector<checkpoint> kept;
+    if (!context.resume_file.empty())
+    {
+        if (!context.events_file.empty() || !context.snapshots_file.empty())
+        {
+            throw std::runtime_error("A resumed run cannot write a binary event file or a snapshot store");
+        }
+
+        checkpoint_store store = load_checkpoints(output_dir + context.resume_file, context);
+        if (store.text != context.text)
+        {
+            throw std::runtime_error("The checkpoints were taken with the text logs " + std::string(store.text ? "on" : "off"));
+        }
+        for (auto &state : store.checkpoints)
+        {
+            if (resumable(state, context.trace, store.first_changed))
+            {
+                kept.push_back(std::move(state));
+            }
+        }
+    }
+    const checkpoint *resume = kept.empty() ? nullptr : &kept.back();
+
+    event_log events; //!< rendered and written every EVENT_CHUNK_SIZE events
+    events.vectors = &context.vectors;
+    events.stats = &sim.stats;
+    double *write_seconds = sim.stats.host_timing ? &sim.stats.write_seconds : nullptr;
+
+    std::optional<output_sink> execution, system_status;
+    if (context.text && resume != nullptr)
+    {
+        execution.emplace(output_dir + "execution.txt", resume->execution_offset);
+        system_status.emplace(output_dir + "system_status.txt", resume->status_offset);
+    }
+    else if (context.text)
+    {
+        execution.emplace(output_dir + "execution.txt");
+        system_status.emplace(output_dir + "system_status.txt");
+    }
+    if (context.text)
+    {
+        execution->write_seconds = write_seconds;
+        system_status->write_seconds = write_seconds;
+        events.execution = &*execution;
+        events.system_status = &*system_status;
+    }
+
+    std::ofstream binary;
+    if (!context.events_file.empty())
+    {
+        binary.open(output_dir + context.events_file, std::ios::binary);
+        begin_event_file(binary, context.vectors);
+        events.binary = &binary;
+    }
+
+    snapshot_writer snapshots;
+    if (!context.snapshots_file.empty())
+    {
+        begin_snapshots(snapshots, output_dir + context.snapshots_file, context.partitions.size());
+        events.snapshots = &snapshots;
+    }
+
+    std::ofstream checkpoints;
+    if (!context.checkpoint_file.empty())
+    {
+        checkpoints.open(output_dir + context.checkpoint_file, std::ios::binary);
+        begin_checkpoint_file(checkpoints, context);
+        for (const auto &state : kept)
+        {
+            write_checkpoint(checkpoints, state, context);
+        }
+        sim.checkpoints = &checkpoints;
+    }
+
+    // With nothing to render or write, the events are not even recorded
+    events.recording = events.execution != nullptr || events.binary != nullptr || events.snapshots != nullptr;
+
+    int end_time;
+    bool written = true;
+    if (context.cpus > 0)
+    {
+        output_sink metrics(output_dir + "scheduler_metrics.txt"); //!< turnaround, waiting time and utilization
+        metrics.write_seconds = write_seconds;
+        end_time = run_simulation(sim, events, metrics);
+        written = metrics.close();
+    }
+    else
+    {
+        output_sink metrics;
+        end_time = run_simulation(sim, events, metrics, resume);
+    }
+
+    if (execution)
+    {
+        // (a batch reports each scenario once instead)
+        const bool confirm = output_dir.empty();
+        written = close_text_log(*execution, confirm) && written;
+        written = close_text_log(*system_status, confirm) && written;
+    }
+    if (events.binary != nullptr)
+    {
+        binary.close();
+        written = !binary.fail() && written;
+    }
+    if (events.snapshots != nullptr)
+    {
+        written = end_snapshots(snapshots, events.names, context.partitions, end_time) && written;
+    }
+    if (sim.checkpoints != nullptr)
+    {
+        checkpoints.close();
+        written = !checkpoints.fail() && written;
+        sim.checkpoints = nullptr;
+    }
+
+    // last, so that the timings cover every other output
+    if (!context.stats_file.empty())
+    {
+        output_sink summary(output_dir + context.stats_file);
+        write_stats(sim, end_time, summary);
+        written = summary.close() && written;
+    }
+
+    return written ? end_time : -1;
+}
+
+// Runs task(0) ... task(count - 1) on up to 'jobs' threads (0: one per hardware thread).
+// Workers take the next task until there are none left.
+template <typename Task>
+void run_parallel(std::size_t count, unsigned int jobs, const Task &task)
+{
+    if (jobs == 0)
+    {
+        jobs = std::thread::hardware_concurrency();
+    }
+    jobs = std::max<std::size_t>(1, std::min<std::size_t>(jobs, count));
+
+    std::atomic<std::size_t> next_task(0);
+    auto worker = [&]()
+    {
+        for (std::size_t index = next_task++; index < count; index = next_task++)
+        {
+            task(index);
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < jobs; i++)
+    {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto &thread : workers)
+    {
+        thread.join();
+    }
+}
+
+// One scenario of a batch: a directory holding trace.txt, vector_table.txt, device_table.txt,
+// external_files.txt and the program files.
+struct batch_scenario
+{
+    std::string directory;
+    std::string error; // empty if the scenario ran
+    int end_time;
+};
+
+/**
+ * \brief run every scenario directory given on the command line
+ *
+ * Usage: --batch <scenario_directory>... [--jobs <N>] [options]
+ * The scenarios run on N worker threads (default: the number of hardware threads), each one in
+ * its own simulator; the outputs are written next to the inputs.
+ *
+ * @return the exit status: 0 if every scenario ran, 1 if not
+ *
+ */
+int run_batch(int argc, char **argv)
+{
+    simulation_context options; //!< the options shared by all the scenarios
+    std::vector<batch_scenario> scenarios;
+
+    for (int i = 2; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        if (argument.compare(0, 2, "--") == 0)
+        {
+            int last = parse_option(argc, argv, i, options);
+            if (last == -1 || argument == "--replicas")
+            {
+                std::cerr << "Error: Unknown option: " << argument << std::endl;
+                return 1;
+            }
+            i = last;
+        }
+        else
+        {
+            if (argument.back() != '/')
+            {
+                argument += '/';
+            }
+            scenarios.push_back({argument, "", 0});
+        }
+    }
+
+    if (scenarios.empty())
+    {
+        std::cout << "ERROR!\nExpected at least one scenario directory" << std::endl;
+        print_usage();
+        return 1;
+    }
+
+    try
+    {
+        check_options(options, false);
+    }
+    catch (const std::exception &error)
+    {
+        std::cerr << "Error: " << error.what() << std::endl;
+        return 1;
+    }
+
+    run_parallel(scenarios.size(), options.jobs, [&](std::size_t index)
+    {
+        batch_scenario &scenario = scenarios[index];
+        const std::string &dir = scenario.directory;
+        try
+        {
+            const double start = host_clock();
+            simulation_context context = options;
+            load_scenario(context, dir + "trace.txt", dir + "vector_table.txt", dir + "device_table.txt", dir + "external_files.txt", dir);
+
+            simulator sim(context);
+            sim.stats.parse_seconds = host_clock() - start;
+            scenario.end_time = run_simulation(sim, dir);
+            if (scenario.end_time < 0)
+            {
+                scenario.error = "Unable to write the output files";
+            }
+        }
+        catch (const std::exception &error)
+        {
+            scenario.error = error.what();
+        }
+    });
+
+    // Report in the order the scenarios were given
+    int status = 0;
+    for (const auto &scenario : scenarios)
+    {
+        if (scenario.error.empty())
+        {
+            std::cout << scenario.directory << ": done at " << scenario.end_time << " ms" << std::endl;
+        }
+        else
+        {
+            std::cerr << scenario.directory << ": Error: " << scenario.error << std::endl;
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Timings of one replica
+struct replica_result
+{
+    int end_time;
+    std::vector<std::pair<unsigned int, int>> finish_times; // (PID, time) of each process
+};
+
+// Draws the device delays of a replica, each one uniformly within +/- percent % of the table's
+// (and at least 1 ms, since a delay is split at random)
+void jitter_delays(simulator &sim, unsigned int percent)
+{
+    for (int &delay : sim.delays)
+    {
+        const long long spread = static_cast<long long>(delay) * percent / 100;
+        delay += static_cast<int>(static_cast<long long>(sim.rng() % (2 * spread + 1)) - spread);
+        delay = std::max(delay, 1);
+    }
+}
+
+/**
+ * \brief run context.replicas replicas of the scenario and write their timing statistics
+ *
+ * Replica r runs in its own simulator, seeded with context.seed + r, so every replica is
+ * reproducible on its own (replica 0 with the default seed is the single run). The seed only
+ * splits each device delay between the ISR steps, so the replicas differ in their timings only
+ * if --jitter draws their device delays too. No execution or system status log is written; the
+ * distribution (min/mean/p50/p99/max) of the completion time and of each process' finish time
+ * goes to replica_statistics.txt.
+ *
+ * @return the exit status
+ *
+ */
+int run_replicas(const simulation_context &context)
+{
+    std::vector<replica_result> results(context.replicas);
+
+    run_parallel(results.size(), context.jobs, [&](std::size_t replica)
+    {
+        simulator sim(context, context.seed + replica);
+        if (context.jitter > 0)
+        {
+            jitter_delays(sim, context.jitter);
+        }
+        event_log events;
+        events.recording = false;
+        output_sink metrics; // discarded
+        results[replica].end_time = run_simulation(sim, events, metrics);
+        results[replica].finish_times = std::move(sim.finish_times);
+    });
+
+    // Gather the samples: completion times, and finish times indexed by PID
+    std::vector<int> completion;
+    std::vector<std::vector<int>> finish;
+    completion.reserve(results.size());
+    for (const auto &result : results)
+    {
+        completion.push_back(result.end_time);
+        for (const auto &[pid, time] : result.finish_times)
+        {
+            if (pid >= finish.size())
+            {
+                finish.resize(pid + 1);
+            }
+            finish[pid].push_back(time);
+        }
+    }
+
+    output_sink statistics("replica_statistics.txt");
+    statistics += "replicas: " + std::to_string(results.size()) + " (seeds " + std::to_string(context.seed) + " to " + std::to_string(context.seed + results.size() - 1) + ")";
+    statistics += context.jitter > 0 ? ", device delays within +/- " + std::to_string(context.jitter) + " %\n" : "\n";
+    statistics += "                     |       runs |        min |          mean |        p50 |        p99 |        max\n";
+
+    auto row = [&](const std::string &name, std::vector<int> &samples)
+    {
+        distribution timing = summarize(samples);
+        char line[160];
+        snprintf(line, sizeof(line), "%20s | %10zu | %10d | %13.1f | %10d | %10d | %10d\n",
+                 name.c_str(), samples.size(), timing.min, timing.mean, timing.p50, timing.p99, timing.max);
+        statistics += line;
+    };
+
+    row("completion time", completion);
+    for (std::size_t pid = 0; pid < finish.size(); pid++)
+    {
+        if (!finish[pid].empty())
+        {
+            row("PID " + std::to_string(pid) + " finish", finish[pid]);
+        }
+    }
+
+    if (!statistics.close())
+    {
+        return 1;
+    }
+    std::cout << "Output generated in replica_statistics.txt" << std::endl;
+    return 0;
+}
+
+// Packs the four input files (and the program files they name) into a binary scenario.
+// Usage: --convert <trace> <vector_table> <device_table> <external_files> <scenario.bin>
+int convert_scenario(int argc, char **argv)
+{
+    if (argc != 7)
+    {
+        std::cout << "ERROR!\nExpected 5 argument after --convert, received " << argc - 2 << std::endl;
+        print_usage();
+        return 1;
+    }
+
+    try
+    {
+        simulation_context context;
+        load_scenario(context, argv[2], argv[3], argv[4], argv[5], "");
+        save_scenario(context, argv[6]);
+    }
+    catch (const std::exception &error)
+    {
+        std::cerr << "Error: " << error.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Scenario written to " << argv[6] << std::endl;
+    return 0;
+}
+
+// Renders execution.txt and system_status.txt (in the current directory) from a binary event log.
+// Usage: --render <events.bin>
+int render_events(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        std::cout << "ERROR!\nExpected 1 argument after --render, received " << argc - 2 << std::endl;
+        print_usage();
+        return 1;
+    }
+
+    output_sink execution("execution.txt");
+    output_sink system_status("system_status.txt");
+    try
+    {
+        render_event_file(argv[2], execution, system_status);
+    }
+    catch (const std::exception &error)
+    {
+        std::cerr << "Error: " << error.what() << std::endl;
+        return 1;
+    }
+
+    if (!execution.close() || !system_status.close())
+    {
+        return 1;
+    }
+    std::cout << "Output generated in execution.txt" << std::endl;
+    return 0;
+}
+
+// Prints the state at a time (the last snapshot before it and the holder of each partition), or
+// the intervals during which a partition was held, from a snapshot store written with --snapshots.
+// Usage: --query <snapshots.bin> <time>, or --query <snapshots.bin> partition <N> [<from> <to>]
+int query_snapshots(int argc, char **argv)
+{
+    const bool partition_query = argc > 3 && std::string(argv[3]) == "partition";
+    if (partition_query ? argc != 5 && argc != 7 : argc != 4)
+    {
+        std::cout << "ERROR!\nExpected <time> or partition <N> [<from> <to>] after --query <snapshots.bin>" << std::endl;
+        print_usage();
+        return 1;
+    }
+
+    output_sink output(std::cout);
+    try
+    {
+        if (partition_query)
+        {
+            const unsigned int number = number_argument<unsigned int>(argv[4], "Expected a partition number after partition");
+            const int from = argc == 7 ? number_argument<int>(argv[5], "Expected a start time after partition " + std::string(argv[4])) : 0;
+            const int to_argument = argc == 7 ? number_argument<int>(argv[6], "Expected an end time after partition " + std::string(argv[4]) + " " + argv[5]) : 0;
+
+            const snapshot_store store(argv[2]);
+            const int to = argc == 7 ? to_argument : store.index.end_time;
+            if (number == 0 || number > store.sizes.size())
+            {
+                throw std::runtime_error("No partition " + std::to_string(number) + " in the snapshot store");
+            }
+
+            auto [begin, end] = store.occupied(number, from, to);
+            output.print("partition ", number, " (", store.sizes[number - 1], " Mb) between ", from, " and ", to, ":\n");
+            for (const partition_interval *interval = begin; interval != end; interval++)
+            {
+                output.print("PID ", interval->pid, ": ", interval->start, " to ", interval->end, '\n');
+            }
+            if (begin == end)
+            {
+                output.print("free\n");
+            }
+        }
+        else
+        {
+            const int time = number_argument<int>(argv[3], "Expected a time or partition after --query " + std::string(argv[2]));
+            const snapshot_store store(argv[2]);
+            stored_snapshot state;
+            if (store.state_at(time, state))
+            {
+                // rendered like the system status log
+                event_log snapshot;
+                snapshot.names = store.names;
+                const packed_snapshot &record = state.record;
+                snapshot.add(record.time, 0, record.kind, record.pid, record.operand, -1, record.name);
+                for (const auto &row : state.rows)
+                {
+                    snapshot.add(record.time, 0, row.state, row.pid, row.size, row.partition, row.name);
+                }
+                output.print("state at ", time, ", as of the last snapshot:\n");
+                render_status(snapshot, output);
+            }
+            else
+            {
+                output.print("state at ", time, ": no snapshot taken yet\n\n");
+            }
+
+            output.print("partitions at ", time, ":\n");
+            for (unsigned int number = 1; number <= store.sizes.size(); number++)
+            {
+                output.print("partition ", number, " (", store.sizes[number - 1], " Mb): ");
+                if (const partition_interval *holder = store.holder(number, time))
+                    output.print("PID ", holder->pid, " since ", holder->start, '\n');
+                else
+                    output.print("free\n");
+            }
+        }
+    }
+    catch (const std::exception &error)
+    {
+        std::cerr << "Error: " << error.what() << std::endl;
+        return 1;
+    }
+
+    return output.close() ? 0 : 1;
+}
+
+// The benchmarks include this file for the engine, with their own main
+#ifndef INTERRUPTS_NO_MAIN
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && std::string(argv[1]) == "--batch")
+    {
+        return run_batch(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--convert")
+    {
+        return convert_scenario(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--render")
+    {
+        return render_events(argc, argv);
+    }
+    if (argc > 1 && std::string(argv[1]) == "--query")
+    {
+        return query_snapshots(argc, argv);
+    }
+
+    // context.vectors is a C++ std::vector of strings that contain the address of the ISR
+    // context.delays  is a C++ std::vector of ints that contain the delays of each device
+    // the index of these elemens is the device number, starting from 0
+    // context.external_files is a C++ std::vector of the struct 'external_file'. Check the struct in
+    // interrupt.hpp to know more.
+    // The context is built once and only read (by const reference) from here on.
+    // context.trace is the compiled trace file, context.programs the loaded programs.
+    const double start = host_clock();
+    const simulation_context context = parse_args(argc, argv);
+    const double parse_seconds = host_clock() - start;
+
+    // Just a sanity check to know what files you have
+    print_external_files(context.external_files);
+
+    if (context.replicas > 0)
+    {
+        return run_replicas(context);
+    }
+
+    // The simulator owns the partition table (set up from the context), the PIDs and the RNG
+    simulator sim(context);
+    sim.stats.parse_seconds = parse_seconds;
+
+    try
+    {
+        if (run_simulation(sim, "") < 0)
+        {
+            std::cerr << "Error opening file!" << std::endl;
+            return 1;
+        }
+    }
+    catch (const std::exception &error)
+    {
+        std::cerr << "Error: " << error.what() << std::endl;
+        return 1;
+    }
+
+    if (!context.resume_file.empty())
+    {
+        if (sim.resumed_time >= 0)
+            std::cout << "Resumed from the checkpoint at " << sim.resumed_time << " ms" << std::endl;
+        else
+            std::cout << "No checkpoint before the first edited trace line, simulated from 0 ms" << std::endl;
+    }
+
+    if (!context.events_file.empty())
+    {
+        std::cout << "Events written to " << context.events_file << std::endl;
+    }
+    if (!context.snapshots_file.empty())
+    {
+        std::cout << "Snapshots written to " << context.snapshots_file << std::endl;
+    }
+    if (!context.stats_file.empty())
+    {
+        std::cout << "Statistics written to " << context.stats_file << std::endl;
+    }
+    if (!context.checkpoint_file.empty())
+    {
+        std::cout << "Checkpoints written to " << context.checkpoint_file << std::endl;
+    }
+
+    return 0;
+}
+
+#endif
@@ -7,351 +7,3903 @@
 #include <vector>
 #include <random>
 #include <utility>
+#include <tuple>
+#include <unordered_map>
+#include <set>
+#include <deque>
+#include <stdexcept>
+#include <thread>
+#include <atomic>
 #include <sstream>
 #include <iomanip>
 #include <algorithm>
 #include <stdio.h>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <charconv>
+#include <string_view>
+#include <optional>
+#include <type_traits>
+#include <chrono>
+#include <numeric>
+#include <limits>
+#include <memory>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define ADDR_BASE 0
 #define VECTOR_SIZE 2
+#define NO_INDEX static_cast<std::size_t>(-1)
+#define NO_BLOCK static_cast<unsigned int>(-1)
 
 struct memory_partition_t
 {
-    const unsigned int partition_number;
-    const unsigned int size;
-    std::string code;
+    unsigned int partition_number;
+    unsigned int size;
+    int occupant; // PID of the process using the partition, -1 if it is free
 
-    memory_partition_t(unsigned int _pn, unsigned int _s, std::string _c) : partition_number(_pn), size(_s), code(_c) {}
+    memory_partition_t(unsigned int _pn, unsigned int _s, int _o) : partition_number(_pn), size(_s), occupant(_o) {}
 };
 
-memory_partition_t memory[] = {
-    memory_partition_t(1, 40, "empty"),
-    memory_partition_t(2, 25, "empty"),
-    memory_partition_t(3, 15, "empty"),
-    memory_partition_t(4, 10, "empty"),
-    memory_partition_t(5, 8, "empty"),
-    memory_partition_t(6, 2, "empty")};
+// Default partition layout (sizes in Mb, partition i + 1 has size DEFAULT_PARTITIONS[i])
+const std::vector<unsigned int> DEFAULT_PARTITIONS = {40, 25, 15, 10, 8, 2};
 
-struct PCB
+// Placement policies of the partition allocator
+enum class fit_policy
 {
-    unsigned int PID;
-    int PPID;
-    std::string program_name;
-    unsigned int size;
-    int partition_number;
+    FIRST_FIT, // lowest numbered free partition that fits
+    BEST_FIT,  // smallest free partition that fits
+    WORST_FIT  // largest free partition, if it fits
+};
 
-    PCB(unsigned int _pid, int _ppid, std::string _pn, unsigned int _size, int _part_num) : PID(_pid), PPID(_ppid), program_name(_pn), size(_size), partition_number(_part_num) {}
+// Page replacement policies of the paging memory model (see page_memory)
+enum class replacement_policy
+{
+    FIFO, // the page loaded first
+    LRU,  // the page run least recently
+    CLOCK // second chance: the next page from the clock hand not run since the hand last passed it
 };
 
-struct external_file
+// Max segment tree over slots (partitions or size buckets). A slot holds 0 when it has nothing
+// free, so finding the leftmost slot holding at least some value is O(log n).
+struct max_tree
 {
-    std::string program_name;
-    unsigned int size;
+    std::size_t leaves = 0;
+    std::vector<std::uint64_t> nodes;
 };
 
-// Allocates a program to memory (if there is space)
-// returns true if the allocation was sucessful, false if not.
-bool allocate_memory(PCB *current)
+void tree_init(max_tree &tree, std::size_t slots)
 {
-    for (int i = 5; i >= 0; i--)
-    { // Start from smallest partition
-        // check is the code will fit and if the partition is empty
-        if (memory[i].size >= current->size && memory[i].code == "empty")
-        {
-            current->partition_number = memory[i].partition_number;
-            memory[i].code = current->program_name;
-            return true;
-        }
+    tree.leaves = 1;
+    while (tree.leaves < slots)
+    {
+        tree.leaves *= 2;
     }
-    return false;
+    tree.nodes.assign(2 * tree.leaves, 0);
 }
 
-// frees the memory given PCB.
-void free_memory(PCB *process)
+void tree_set(max_tree &tree, std::size_t slot, std::uint64_t value)
 {
-    memory[process->partition_number - 1].code = "empty";
-    process->partition_number = -1;
+    std::size_t node = tree.leaves + slot;
+    tree.nodes[node] = value;
+    for (node /= 2; node >= 1; node /= 2)
+    {
+        tree.nodes[node] = std::max(tree.nodes[2 * node], tree.nodes[2 * node + 1]);
+    }
 }
 
-// Following function was taken from stackoverflow; helper function for splitting strings
-std::vector<std::string> split_delim(std::string input, std::string delim)
+// returns the leftmost slot holding a value >= min_value, or NO_INDEX
+std::size_t tree_leftmost(const max_tree &tree, std::uint64_t min_value)
 {
-    std::vector<std::string> tokens;
-    std::size_t pos = 0;
-    std::string token;
-    while ((pos = input.find(delim)) != std::string::npos)
+    if (tree.nodes.empty() || tree.nodes[1] < min_value)
     {
-        token = input.substr(0, pos);
-        tokens.push_back(token);
-        input.erase(0, pos + delim.length());
+        return NO_INDEX;
     }
-    tokens.push_back(input);
 
-    return tokens;
+    std::size_t node = 1;
+    while (node < tree.leaves)
+    {
+        node = (tree.nodes[2 * node] >= min_value) ? 2 * node : 2 * node + 1;
+    }
+    return node - tree.leaves;
 }
 
-/**
- * \brief parse the CLI arguments
- *
- * This helper function parses command line arguments and checks for errors
- *
- * @param argc number of command line arguments
- * @param argv the command line arguments
- * @return a vector of strings (the parsed vector table), a vector of delays, a vector of external files
- *
- */
-std::tuple<std::vector<std::string>, std::vector<int>, std::vector<external_file>> parse_args(int argc, char **argv)
+// Partition table with free-partition tracking, so a placement never scans the whole table.
+//  * first fit: a max tree of the free size of each partition (in partition number order)
+//  * best/worst fit: free lists bucketed by size, and a max tree over the non-empty buckets
+// Tree values are size + 1, so that a free partition of size 0 is not mistaken for a used one.
+struct partition_allocator
+{
+    std::vector<memory_partition_t> partitions;
+    fit_policy policy = fit_policy::BEST_FIT;
+
+    max_tree by_number;                                 // first fit
+    std::vector<unsigned int> bucket_sizes;             // distinct partition sizes, ascending
+    std::vector<unsigned int> bucket_of;                // size bucket of each partition
+    std::vector<std::vector<unsigned int>> bucket_free; // free partitions of each bucket
+    std::vector<unsigned int> free_slot;                // position of each free partition in its bucket
+    max_tree by_size;                                   // best/worst fit
+    unsigned int occupied = 0;                          // partitions in use
+};
+
+// Marks a partition (by index) as free or used in the tracking structures
+void track_partition(partition_allocator &memory, unsigned int index, bool free)
 {
-    if (argc != 5)
+    const unsigned int bucket = memory.bucket_of[index];
+    const std::uint64_t value = std::uint64_t(memory.partitions[index].size) + 1;
+
+    tree_set(memory.by_number, index, free ? value : 0);
+
+    std::vector<unsigned int> &list = memory.bucket_free[bucket];
+    if (free)
     {
-        std::cout << "ERROR!\nExpected 4 argument, received " << argc - 1 << std::endl;
-        std::cout << "To run the program, do: ./interrutps <your_trace_file.txt> <your_vector_table.txt> <your_device_table.txt> <your_external_files.txt>" << std::endl;
-        exit(1);
+        memory.free_slot[index] = list.size();
+        list.push_back(index);
     }
-
-    std::ifstream input_file;
-    input_file.open(argv[1]);
-    if (!input_file.is_open())
+    else
     {
-        std::cerr << "Error: Unable to open file: " << argv[1] << std::endl;
-        exit(1);
+        // O(1) removal: move the last free partition of the bucket into the hole
+        unsigned int moved = list.back();
+        list[memory.free_slot[index]] = moved;
+        memory.free_slot[moved] = memory.free_slot[index];
+        list.pop_back();
     }
-    input_file.close();
+    tree_set(memory.by_size, bucket, list.empty() ? 0 : value);
+}
 
-    input_file.open(argv[2]);
-    if (!input_file.is_open())
+// (Re)builds the partition table from a list of sizes, every partition starting free
+void init_memory(partition_allocator &memory, const std::vector<unsigned int> &sizes, fit_policy policy)
+{
+    memory.policy = policy;
+    memory.occupied = 0;
+    memory.partitions.clear();
+    memory.partitions.reserve(sizes.size());
+    for (std::size_t i = 0; i < sizes.size(); i++)
     {
-        std::cerr << "Error: Unable to open file: " << argv[2] << std::endl;
-        exit(1);
+        memory.partitions.emplace_back(i + 1, sizes[i], -1);
     }
 
-    std::string vector;
-    std::vector<std::string> vectors;
-    while (std::getline(input_file, vector))
+    memory.bucket_sizes = sizes;
+    std::sort(memory.bucket_sizes.begin(), memory.bucket_sizes.end());
+    memory.bucket_sizes.erase(std::unique(memory.bucket_sizes.begin(), memory.bucket_sizes.end()), memory.bucket_sizes.end());
+
+    memory.bucket_of.resize(sizes.size());
+    for (std::size_t i = 0; i < sizes.size(); i++)
     {
-        vectors.push_back(vector);
+        memory.bucket_of[i] = std::lower_bound(memory.bucket_sizes.begin(), memory.bucket_sizes.end(), sizes[i]) - memory.bucket_sizes.begin();
     }
-    input_file.close();
 
-    std::string duration;
-    std::vector<int> delays;
-    input_file.open(argv[3]);
+    memory.bucket_free.assign(memory.bucket_sizes.size(), {});
+    memory.free_slot.assign(sizes.size(), 0);
+    tree_init(memory.by_number, sizes.size());
+    tree_init(memory.by_size, memory.bucket_sizes.size());
 
-    if (!input_file.is_open())
+    // higher numbers first, so each free list starts by handing out its lowest numbered partition
+    for (std::size_t i = sizes.size(); i-- > 0;)
     {
-        std::cerr << "Error: Unable to open file: " << argv[3] << std::endl;
-        exit(1);
+        track_partition(memory, i, true);
     }
+}
 
-    while (std::getline(input_file, duration))
+// Returns the index of the free partition chosen by the policy for a program, or NO_INDEX
+std::size_t find_partition(const partition_allocator &memory, unsigned int size)
+{
+    const std::uint64_t needed = std::uint64_t(size) + 1;
+
+    if (memory.policy == fit_policy::FIRST_FIT)
     {
-        delays.push_back(std::stoi(duration));
+        return tree_leftmost(memory.by_number, needed);
     }
-    input_file.close();
 
-    std::vector<external_file> external_files;
-    input_file.open(argv[4]);
-    if (!input_file.is_open())
+    std::size_t bucket;
+    if (memory.policy == fit_policy::BEST_FIT)
     {
-        std::cerr << "Error: Unable to open file: " << argv[4] << std::endl;
-        exit(1);
+        // buckets are sorted by size: the leftmost free one that fits is the smallest
+        bucket = tree_leftmost(memory.by_size, needed);
+    }
+    else
+    {
+        // the largest free bucket is the one holding the maximum
+        bucket = memory.by_size.nodes.empty() ? NO_INDEX : tree_leftmost(memory.by_size, std::max(needed, memory.by_size.nodes[1]));
     }
 
-    std::string file_content;
-    while (std::getline(input_file, file_content))
+    return bucket == NO_INDEX ? NO_INDEX : memory.bucket_free[bucket].back();
+}
+
+struct PCB
+{
+    unsigned int PID;
+    int PPID;
+    unsigned int program; // id of the program in the registry (names are interned, see program_registry)
+    unsigned int size;
+    int partition_number;
+
+    PCB(unsigned int _pid, int _ppid, unsigned int _program, unsigned int _size, int _part_num) : PID(_pid), PPID(_ppid), program(_program), size(_size), partition_number(_part_num) {}
+};
+
+// One level of the simulation: a process running a trace. Frames live on an explicit stack
+// (see simulate_trace); the frames below the top one belong to parents waiting for a child.
+struct frame
+{
+    const struct compiled_trace *trace; // the trace being run (the trace file or a program image)
+    std::size_t pc;                     // index of the next instruction
+    unsigned int process;               // index of the PCB in the process table
+    int start_time;                     // time at which the frame started running
+    bool fixed_start = false;           // speculative branch: start_time is not relative to the branch
+};
+
+struct external_file
+{
+    std::string program_name;
+    unsigned int size;
+    int priority = 0; // optional third column, used by the priority scheduler (lower runs first)
+};
+
+// Allocates a program to memory (if there is space), placing it according to the policy.
+// returns true if the allocation was sucessful, false if not.
+bool allocate_memory(partition_allocator &memory, PCB *current)
+{
+    std::size_t index = find_partition(memory, current->size);
+    if (index == NO_INDEX)
     {
-        external_file entry;
-        auto file_info = split_delim(file_content, ",");
+        return false;
+    }
 
-        entry.program_name = file_info[0];
-        entry.size = std::stoi(file_info[1]);
-        external_files.push_back(entry);
+    memory_partition_t &partition = memory.partitions[index];
+    current->partition_number = partition.partition_number;
+    partition.occupant = current->PID;
+    track_partition(memory, index, false);
+    memory.occupied++;
+    return true;
+}
+
+// frees the memory given PCB.
+void free_memory(partition_allocator &memory, PCB *process)
+{
+    std::size_t index = process->partition_number - 1;
+    if (memory.partitions[index].occupant == static_cast<int>(process->PID))
+    { // a partition is only released once, by the process holding it
+        memory.partitions[index].occupant = -1;
+        track_partition(memory, index, true);
+        memory.occupied--;
+    }
+    process->partition_number = -1;
+}
+
+#define NO_FRAME -1 //!< page table entry of a page that is not in memory
+
+// Paging memory model (--paging on): memory is a table of fixed-size frames and each process has
+// a page table. EXEC loads nothing: a page is loaded when an instruction on it first runs (a page
+// fault), into a free frame, or in place of the page the replacement policy picks. The frames in
+// use are linked oldest first: in load order (FIFO), or in order of last use (LRU, a used frame
+// moves to the tail), so that both take their victim at the head.
+struct page_memory
+{
+    unsigned int frame_size = 4; // Mb
+    replacement_policy policy = replacement_policy::FIFO;
+
+    std::vector<unsigned int> owner;      // PID of the process whose page a frame holds (if in use)
+    std::vector<unsigned int> page;       // ... and which of its pages
+    std::vector<uint8_t> referenced;      // clock: run since the hand last passed the frame
+    std::vector<int> older, newer;        // the list of frames in use (NO_FRAME: its end)
+    int head = NO_FRAME, tail = NO_FRAME; // oldest and newest frames in use
+    std::vector<int> free_frames;
+    std::size_t hand = 0;                 // clock: the next frame it looks at
+    std::vector<std::vector<int>> tables; // page table of each PID: the frame of each page
+};
+
+void init_pages(page_memory &memory, unsigned int frames, unsigned int frame_size, replacement_policy policy)
+{
+    memory.frame_size = frame_size;
+    memory.policy = policy;
+    memory.owner.assign(frames, 0);
+    memory.page.assign(frames, 0);
+    memory.referenced.assign(frames, 0);
+    memory.older.assign(frames, NO_FRAME);
+    memory.newer.assign(frames, NO_FRAME);
+    memory.head = memory.tail = NO_FRAME;
+    memory.free_frames.clear();
+    for (int frame = static_cast<int>(frames) - 1; frame >= 0; frame--)
+    {
+        memory.free_frames.push_back(frame); // frame 0 is used first
     }
+    memory.hand = 0;
+    memory.tables.clear();
+}
+
+// Takes a frame out of the list of frames in use
+void unlink_frame(page_memory &memory, int frame)
+{
+    const int before = memory.older[frame], after = memory.newer[frame];
+    (before != NO_FRAME ? memory.newer[before] : memory.head) = after;
+    (after != NO_FRAME ? memory.older[after] : memory.tail) = before;
+}
 
-    input_file.close();
+// Puts a frame at the tail of the list of frames in use
+void link_frame(page_memory &memory, int frame)
+{
+    memory.older[frame] = memory.tail;
+    memory.newer[frame] = NO_FRAME;
+    (memory.tail != NO_FRAME ? memory.newer[memory.tail] : memory.head) = frame;
+    memory.tail = frame;
+}
+
+// Gives back the frames of a process and empties its page table
+void unmap_process(page_memory &memory, unsigned int pid)
+{
+    if (pid >= memory.tables.size())
+    {
+        return;
+    }
+    for (int &frame : memory.tables[pid])
+    {
+        if (frame != NO_FRAME)
+        {
+            unlink_frame(memory, frame);
+            memory.free_frames.push_back(frame);
+            frame = NO_FRAME;
+        }
+    }
+    memory.tables[pid].clear();
+}
 
-    return {vectors, delays, external_files};
+// Gives a process the page table of a program of 'size' Mb, with no page in memory yet (the
+// frames of its previous program are given back)
+void map_process(page_memory &memory, unsigned int pid, unsigned int size)
+{
+    if (pid >= memory.tables.size())
+    {
+        memory.tables.resize(pid + 1);
+    }
+    unmap_process(memory, pid);
+    memory.tables[pid].assign(std::max(1u, (size + memory.frame_size - 1) / memory.frame_size), NO_FRAME);
 }
 
-// Parces each trace and returns a tuple: {Tace activity, duration or interrupt number, program name (if applicable)}
-std::tuple<std::string, int, std::string> parse_trace(std::string trace)
+/**
+ * \brief run an instruction on a page of a process
+ *
+ * A page in memory is marked as used. A page that is not is loaded into a free frame or, if every
+ * frame is in use, into the frame of the page picked by the replacement policy.
+ *
+ * @param memory the frame table
+ * @param pid the process
+ * @param page the page, in the process's page table
+ * @param replaced set to true if another page was replaced
+ * @return true if the page was in memory, false if it had to be loaded (a page fault)
+ *
+ */
+bool touch_page(page_memory &memory, unsigned int pid, unsigned int page, bool &replaced)
 {
-    // split line by ','
-    auto parts = split_delim(trace, ",");
-    if (parts.size() < 2)
+    int &entry = memory.tables[pid][page];
+    if (entry != NO_FRAME)
+    {
+        memory.referenced[entry] = 1;
+        if (memory.policy == replacement_policy::LRU && entry != memory.tail)
+        {
+            unlink_frame(memory, entry);
+            link_frame(memory, entry);
+        }
+        return true;
+    }
+
+    int frame;
+    replaced = memory.free_frames.empty();
+    if (!replaced)
     {
-        std::cerr << "Error: Malformed input line: " << trace << std::endl;
-        return {"null", -1, "null"};
+        frame = memory.free_frames.back();
+        memory.free_frames.pop_back();
+    }
+    else
+    {
+        // (every frame is in use, so the clock hand finds one within two turns)
+        frame = memory.head;
+        while (memory.policy == replacement_policy::CLOCK)
+        {
+            frame = static_cast<int>(memory.hand);
+            memory.hand = (memory.hand + 1) % memory.owner.size();
+            if (!memory.referenced[frame])
+            {
+                break;
+            }
+            memory.referenced[frame] = 0;
+        }
+        memory.tables[memory.owner[frame]][memory.page[frame]] = NO_FRAME;
+        unlink_frame(memory, frame);
     }
 
-    auto activity = parts[0];
-    auto duration_intr = std::stoi(parts[1]);
-    std::string extern_file = "null";
+    memory.owner[frame] = pid;
+    memory.page[frame] = page;
+    memory.referenced[frame] = 1;
+    link_frame(memory, frame);
+    entry = frame;
+    return false;
+}
 
-    auto exec = split_delim(parts[0], " ");
-    if (exec[0] == "EXEC")
+// Following function was taken from stackoverflow; helper function for splitting strings
+// (each token is copied once, from a moving start position)
+std::vector<std::string> split_delim(const std::string &input, const std::string &delim)
+{
+    std::vector<std::string> tokens;
+    std::size_t start = 0, pos;
+    while ((pos = input.find(delim, start)) != std::string::npos)
     {
-        extern_file = exec[1];
-        activity = "EXEC";
+        tokens.push_back(input.substr(start, pos - start));
+        start = pos + delim.length();
     }
+    tokens.push_back(input.substr(start));
 
-    return {activity, duration_intr, extern_file};
+    return tokens;
 }
 
-// Default interrupt boilerplate
-std::pair<std::string, int> intr_boilerplate(int current_time, int intr_num, int context_save_time, std::vector<std::string> vectors)
+// Trace activities, decoded once when a trace file is loaded
+enum class opcode : unsigned char
+{
+    CPU,
+    SYSCALL,
+    END_IO,
+    FORK,
+    IF_CHILD,
+    IF_PARENT,
+    ENDIF,
+    EXEC,
+    INTERRUPT // an interrupt type of the --isr file ('program' is its handler)
+};
+
+#define OPCODE_COUNT 9 //!< number of opcodes
+
+// Trace keyword of each opcode
+const char *const OPCODE_NAMES[OPCODE_COUNT] = {"CPU", "SYSCALL", "END_IO", "FORK", "IF_CHILD", "IF_PARENT", "ENDIF", "EXEC", "INTERRUPT"};
+
+// A single pre-decoded trace line
+struct instruction
 {
+    opcode op;
+    int operand;          // duration or interrupt number
+    unsigned int program; // interned program name (EXEC), or handler (INTERRUPT)
+    unsigned int block;   // index into compiled_trace::forks (FORK and IF_PARENT only)
+};
+
+// Index ranges of one FORK's IF_CHILD/IF_PARENT/ENDIF regions, matched once at load time.
+// A missing IF_CHILD or IF_PARENT gives an empty range; a missing ENDIF ends at the end of the trace.
+struct fork_block
+{
+    std::size_t child_begin, child_end;   // child block (after IF_CHILD)
+    std::size_t parent_begin, parent_end; // parent block (after IF_PARENT)
+    std::size_t post_begin;               // code after ENDIF, run by both processes
+};
 
-    std::string execution = "";
+// A trace after compilation: the instructions and the branch table of its FORKs
+struct compiled_trace
+{
+    std::vector<instruction> instructions;
+    std::vector<fork_block> forks;
+};
 
-    execution += std::to_string(current_time) + ", " + std::to_string(1) + ", switch to kernel mode\n";
-    current_time++;
 
-    execution += std::to_string(current_time) + ", " + std::to_string(context_save_time) + ", context saved\n";
-    current_time += context_save_time;
+#define UNKNOWN_SIZE static_cast<unsigned int>(-1) //!< size of a program missing from the external files
+#define INIT_PROGRAM "init"                         //!< program of the first process (registered by load_scenario)
 
-    char vector_address_c[10];
-    sprintf(vector_address_c, "0x%04X", (ADDR_BASE + (intr_num * VECTOR_SIZE)));
-    std::string vector_address(vector_address_c);
+// A program that can be EXECed: its size and its trace, loaded at most once
+struct program_image
+{
+    std::string name;
+    unsigned int size;    // size in Mb (UNKNOWN_SIZE if not in the external files table)
+    compiled_trace trace; // compiled program file (empty if the file does not exist)
+    int priority;         // scheduling priority of processes running this program
+};
 
-    execution += std::to_string(current_time) + ", " + std::to_string(1) + ", find vector " + std::to_string(intr_num) + " in memory position " + vector_address + "\n";
-    current_time++;
+// Program registry indexed by interned name. Instructions and PCBs refer to programs by id.
+struct program_registry
+{
+    std::vector<program_image> images;
+    std::unordered_map<std::string, unsigned int> ids;
+    std::unordered_map<std::string, unsigned int> interrupts; // interrupt types of the --isr file, by handler
+};
 
-    execution += std::to_string(current_time) + ", " + std::to_string(1) + ", load address " + vectors.at(intr_num) + " into the PC\n";
-    current_time++;
+// Returns the id of a program name, adding it to the registry if it is new
+unsigned int intern_program(program_registry &programs, const std::string &name)
+{
+    auto found = programs.ids.find(name);
+    if (found != programs.ids.end())
+    {
+        return found->second;
+    }
 
-    return std::make_pair(execution, current_time);
+    unsigned int id = programs.images.size();
+    programs.images.push_back({name, UNKNOWN_SIZE, {}, 0});
+    programs.ids.emplace(name, id);
+    return id;
 }
 
-// Writes a string to a file
-void write_output(std::string execution, const char *filename)
+// Parses one trace line ("ACTIVITY, operand" or "EXEC name, operand") into an instruction.
+// returns false if the line is malformed or the activity is unknown.
+bool parse_instruction(const std::string &line, program_registry &programs, instruction &out)
 {
-    std::ofstream output_file(filename);
+    std::size_t comma = line.find(',');
+    if (comma == std::string::npos)
+    {
+        std::cerr << "Error: Malformed input line: " << line << std::endl;
+        return false;
+    }
+
+    // Same rules as std::stoi: leading whitespace, optional sign, at least one digit
+    const char *number = line.c_str() + comma + 1;
+    char *number_end = nullptr;
+    long operand = std::strtol(number, &number_end, 10);
+    if (number_end == number)
+    {
+        std::cerr << "Error: Malformed input line: " << line << std::endl;
+        return false;
+    }
+
+    out.operand = static_cast<int>(operand);
+    out.program = 0;
+    out.block = NO_BLOCK;
+
+    // The activity is looked up in the keyword table, then in the interrupt types
+    static const std::unordered_map<std::string_view, opcode> keywords = {
+        {"CPU", opcode::CPU}, {"SYSCALL", opcode::SYSCALL}, {"END_IO", opcode::END_IO}, {"FORK", opcode::FORK},
+        {"IF_CHILD", opcode::IF_CHILD}, {"IF_PARENT", opcode::IF_PARENT}, {"ENDIF", opcode::ENDIF}};
 
-    if (output_file.is_open())
+    const std::string_view activity(line.data(), comma);
+    auto keyword = keywords.find(activity);
+    if (keyword != keywords.end())
     {
-        output_file << execution;
-        output_file.close(); // Close the file when done
-        std::cout << "File content overwritten successfully." << std::endl;
+        out.op = keyword->second;
+    }
+    else if (auto custom = programs.interrupts.empty() ? programs.interrupts.end() : programs.interrupts.find(std::string(activity));
+             custom != programs.interrupts.end())
+    {
+        out.op = opcode::INTERRUPT;
+        out.program = custom->second;
+    }
+    else if (comma > 5 && line.compare(0, 5, "EXEC ") == 0)
+    {
+        // the program name is the word after "EXEC"
+        std::size_t name_end = line.find(' ', 5);
+        if (name_end == std::string::npos || name_end > comma)
+        {
+            name_end = comma;
+        }
+        out.op = opcode::EXEC;
+        out.program = intern_program(programs, line.substr(5, name_end - 5));
     }
     else
     {
-        std::cerr << "Error opening file!" << std::endl;
+        return false; // unknown activities are ignored by the simulator
     }
 
-    std::cout << "Output generated in execution.txt" << std::endl;
+    return true;
 }
 
-// Helper function for a sanity check. Prints the external files table
-void print_external_files(std::vector<external_file> files)
+// Matches nested FORK/IF_CHILD/IF_PARENT/ENDIF markers with a stack, one instruction at a time.
+// FORK and IF_PARENT instructions get the index of their fork_block; each block is handed to
+// done(index, block) once its ENDIF (or the end of the trace) closes it.
+struct branch_matcher
 {
-    const int tableWidth = 24;
+    std::vector<std::pair<unsigned int, fork_block>> open; // blocks whose ENDIF has not been seen yet
+    unsigned int blocks = 0;                               // blocks created so far
 
-    std::cout << "List of external files (" << files.size() << " entry(s)): " << std::endl;
+    // empty ranges for missing markers
+    static void close(fork_block &block)
+    {
+        if (block.child_begin == NO_INDEX)
+        {
+            block.child_begin = block.child_end = block.post_begin;
+        }
+        if (block.parent_begin == NO_INDEX)
+        {
+            block.parent_begin = block.parent_end = block.post_begin;
+        }
+    }
 
-    // Print top border
-    std::cout << "+" << std::setfill('-') << std::setw(tableWidth) << "+" << std::endl;
+    // Matches instruction j of the trace
+    template <typename Done>
+    void add(instruction &instr, std::size_t j, const Done &done)
+    {
+        if (instr.op == opcode::FORK)
+        {
+            instr.block = blocks++;
+            open.push_back({instr.block, {NO_INDEX, NO_INDEX, NO_INDEX, NO_INDEX, NO_INDEX}});
+            return;
+        }
 
-    // Print headers
-    std::cout << "|"
-              << std::setfill(' ') << std::setw(10) << "file name"
-              << std::setw(2) << "|"
-              << std::setfill(' ') << std::setw(10) << "files size"
-              << std::setw(2) << "|" << std::endl;
+        if (open.empty())
+        {
+            return; // stray markers are ignored
+        }
 
-    // Print separator
-    std::cout << "+" << std::setfill('-') << std::setw(tableWidth) << "+" << std::endl;
+        fork_block &block = open.back().second;
 
-    // Print each PCB entry
-    for (const auto &file : files)
+        if (instr.op == opcode::IF_CHILD && block.child_begin == NO_INDEX && block.parent_begin == NO_INDEX)
+        {
+            block.child_begin = j + 1;
+        }
+        else if (instr.op == opcode::IF_PARENT && block.parent_begin == NO_INDEX)
+        {
+            if (block.child_begin != NO_INDEX)
+            {
+                block.child_end = j;
+            }
+            block.parent_begin = j + 1;
+            instr.block = open.back().first;
+        }
+        else if (instr.op == opcode::ENDIF)
+        {
+            if (block.parent_begin != NO_INDEX)
+            {
+                block.parent_end = j;
+            }
+            else if (block.child_begin != NO_INDEX)
+            {
+                block.child_end = j;
+            }
+            block.post_begin = j + 1;
+            close(block);
+            done(open.back().first, block);
+            open.pop_back();
+        }
+    }
+
+    // Closes the blocks left open at the end of a trace of 'size' instructions
+    template <typename Done>
+    void finish(std::size_t size, const Done &done)
     {
-        std::cout << "|"
-                  << std::setfill(' ') << std::setw(10) << file.program_name
-                  << std::setw(2) << "|"
-                  << std::setw(10) << file.size
-                  << std::setw(2) << "|" << std::endl;
+        // a FORK without ENDIF: its open regions run to the end of the trace
+        for (auto &[id, block] : open)
+        {
+            if (block.parent_begin != NO_INDEX)
+            {
+                block.parent_end = size;
+            }
+            else if (block.child_begin != NO_INDEX)
+            {
+                block.child_end = size;
+            }
+            block.post_begin = size;
+            close(block);
+            done(id, block);
+        }
+        open.clear();
     }
+};
 
-    // Print bottom border
-    std::cout << "+" << std::setfill('-') << std::setw(tableWidth) << "+" << std::endl;
+// Builds the branch table of a trace in one pass (see branch_matcher)
+void match_branches(compiled_trace &trace)
+{
+    branch_matcher matcher;
+    auto done = [&](unsigned int id, const fork_block &block)
+    { trace.forks[id] = block; };
+
+    trace.forks.clear();
+
+    for (std::size_t j = 0; j < trace.instructions.size(); j++)
+    {
+        matcher.add(trace.instructions[j], j, done);
+        trace.forks.resize(matcher.blocks);
+    }
+    matcher.finish(trace.instructions.size(), done);
 }
 
-// This function takes as input: the current PCB and the waitqueue (which is a
-// std::vector of the PCB struct); the function returns the information as a table
-std::string print_PCB(PCB current, std::vector<PCB> _PCB)
+// Compiles a trace into an array of instructions (one-time step, the simulator never sees the text)
+compiled_trace compile_trace(std::istream &input, program_registry &programs)
 {
-    const int tableWidth = 55;
+    compiled_trace trace;
+    std::string line;
+    instruction decoded;
 
-    std::stringstream buffer;
+    while (std::getline(input, line))
+    {
+        if (parse_instruction(line, programs, decoded))
+        {
+            trace.instructions.push_back(decoded);
+        }
+    }
 
-    // Print top border
-    buffer << "+" << std::setfill('-') << std::setw(tableWidth) << "+" << std::endl;
+    match_branches(trace);
 
-    // Print headers
-    buffer << "|"
-           << std::setfill(' ') << std::setw(4) << "PID"
-           << std::setw(2) << "|"
-           << std::setfill(' ') << std::setw(12) << "program name"
-           << std::setw(2) << "|"
-           << std::setfill(' ') << std::setw(16) << "partition number"
-           << std::setw(2) << "|"
-           << std::setfill(' ') << std::setw(5) << "size"
-           << std::setw(2) << "|"
-           << std::setfill(' ') << std::setw(8) << "state"
-           << std::setw(2) << "|" << std::endl;
+    return trace;
+}
 
-    // Print separator
-    buffer << "+" << std::setfill('-') << std::setw(tableWidth) << "+" << std::endl;
-
-    buffer << "|"
-           << std::setfill(' ') << std::setw(4) << current.PID
-           << std::setw(2) << "|"
-           << std::setw(12) << current.program_name
-           << std::setw(2) << "|"
-           << std::setw(16) << current.partition_number
-           << std::setw(2) << "|"
-           << std::setw(5) << current.size
-           << std::setw(2) << "|"
-           << std::setw(8) << "running"
-           << std::setw(2) << "|" << std::endl;
+// Compiles a trace file, a file that cannot be opened gives an empty trace
+compiled_trace compile_trace_file(const std::string &filename, program_registry &programs)
+{
+    std::ifstream input_file(filename);
+    return compile_trace(input_file, programs);
+}
 
-    // Print each PCB entry
-    for (const auto &program : _PCB)
+// Registers the external files and compiles each program file (program_dir + name + ".txt") once.
+// Programs EXECed from these files are registered too (with UNKNOWN_SIZE if not listed).
+void load_programs(program_registry &programs, const std::vector<external_file> &external_files, const std::string &program_dir)
+{
+    for (const auto &file : external_files)
     {
-        buffer << "|"
-               << std::setfill(' ') << std::setw(4) << program.PID
-               << std::setw(2) << "|"
-               << std::setw(12) << program.program_name
-               << std::setw(2) << "|"
-               << std::setw(16) << program.partition_number
-               << std::setw(2) << "|"
-               << std::setw(5) << program.size
-               << std::setw(2) << "|"
-               << std::setw(8) << "waiting"
-               << std::setw(2) << "|" << std::endl;
+        unsigned int id = intern_program(programs, file.program_name);
+        if (programs.images[id].size == UNKNOWN_SIZE)
+        {
+            programs.images[id].size = file.size; // first entry wins, like the old linear search
+            programs.images[id].priority = file.priority;
+        }
     }
 
-    // Print bottom border
-    buffer << "+" << std::setfill('-') << std::setw(tableWidth) << "+" << std::endl;
+    // compiling may register more programs, so loop by index
+    for (std::size_t id = 0; id < programs.images.size(); id++)
+    {
+        if (programs.images[id].size == UNKNOWN_SIZE)
+        {
+            continue; // cannot be loaded into memory, so it never runs
+        }
 
-    return buffer.str();
+        compiled_trace trace = compile_trace_file(program_dir + programs.images[id].name + ".txt", programs);
+        programs.images[id].trace = std::move(trace);
+    }
 }
 
-// Searches the external_files table and returns the size of the program
-unsigned int get_size(std::string name, std::vector<external_file> external_files)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Streaming (--stream on): the trace file is compiled in one pass into temporary files instead
+// of memory, and the sequential simulation reads it back through fixed-size windows. Only the
+// FORK blocks still waiting for their ENDIF are kept while compiling, so memory does not grow
+// with the length of the trace. The windows are re-read when a parent jumps back to its block.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define STREAM_WINDOW 4096 //!< instructions (or fork blocks) read or written at a time
+
+// An unlinked temporary file in $TMPDIR (or /tmp), gone when it is closed
+struct temp_file
 {
-    int size = -1;
+    int fd = -1;
 
-    for (auto file : external_files)
+    temp_file()
     {
-        if (file.program_name == name)
+        const char *dir = std::getenv("TMPDIR");
+        std::string path = std::string(dir != nullptr && *dir != '\0' ? dir : "/tmp") + "/interrupts_XXXXXX";
+        fd = mkstemp(&path[0]);
+        if (fd == -1)
         {
-            size = file.size;
-            break;
+            throw std::runtime_error("Unable to create a temporary file: " + path);
+        }
+        unlink(path.c_str());
+    }
+
+    ~temp_file()
+    {
+        ::close(fd);
+    }
+
+    temp_file(const temp_file &) = delete;
+    temp_file &operator=(const temp_file &) = delete;
+
+    void write_at(const void *data, std::size_t bytes, std::size_t offset)
+    {
+        for (const char *next = static_cast<const char *>(data); bytes > 0;)
+        {
+            ssize_t written = pwrite(fd, next, bytes, offset);
+            if (written <= 0)
+            {
+                throw std::runtime_error("Unable to write a temporary file (disk full?)");
+            }
+            next += written;
+            bytes -= written;
+            offset += written;
         }
     }
 
-    return size;
+    // Safe to call from several threads (pread does not move the file offset)
+    void read_at(void *data, std::size_t bytes, std::size_t offset) const
+    {
+        for (char *next = static_cast<char *>(data); bytes > 0;)
+        {
+            ssize_t read = pread(fd, next, bytes, offset);
+            if (read <= 0)
+            {
+                throw std::runtime_error("Unable to read a temporary file");
+            }
+            next += read;
+            bytes -= read;
+            offset += read;
+        }
+    }
+};
+
+// A compiled trace kept on disk: the instructions and the fork blocks, each array in its own file
+struct spilled_trace
+{
+    std::shared_ptr<temp_file> instructions;
+    std::shared_ptr<temp_file> forks;
+    std::size_t instruction_count = 0;
+    std::size_t fork_count = 0;
+};
+
+// Compiles a trace like compile_trace, into temporary files: the instructions are written
+// STREAM_WINDOW at a time, each fork block when branch_matcher closes it
+spilled_trace spill_trace(std::istream &input, program_registry &programs)
+{
+    spilled_trace spilled = {std::make_shared<temp_file>(), std::make_shared<temp_file>(), 0, 0};
+    branch_matcher matcher;
+    auto done = [&](unsigned int id, const fork_block &block)
+    { spilled.forks->write_at(&block, sizeof(block), id * sizeof(fork_block)); };
+
+    std::vector<instruction> chunk;
+    chunk.reserve(STREAM_WINDOW);
+    auto flush = [&]()
+    {
+        spilled.instructions->write_at(chunk.data(), chunk.size() * sizeof(instruction), (spilled.instruction_count - chunk.size()) * sizeof(instruction));
+        chunk.clear();
+    };
+
+    std::string line;
+    instruction decoded;
+    while (std::getline(input, line))
+    {
+        if (!parse_instruction(line, programs, decoded))
+        {
+            continue;
+        }
+
+        matcher.add(decoded, spilled.instruction_count, done);
+        chunk.push_back(decoded);
+        spilled.instruction_count++;
+        if (chunk.size() == STREAM_WINDOW)
+        {
+            flush();
+        }
+    }
+    flush();
+
+    matcher.finish(spilled.instruction_count, done);
+    spilled.fork_count = matcher.blocks;
+    return spilled;
+}
+
+// Reads an array of a spilled trace through a window of STREAM_WINDOW elements
+template <typename T>
+struct spill_window
+{
+    const temp_file *file;
+    std::size_t count;
+    std::vector<T> window;
+    std::size_t begin = 0; // index of window[0]
+
+    const T &operator[](std::size_t index)
+    {
+        if (index - begin >= window.size()) // also true below 'begin' (the difference wraps)
+        {
+            begin = index - index % STREAM_WINDOW;
+            window.resize(std::min<std::size_t>(STREAM_WINDOW, count - begin));
+            file->read_at(window.data(), window.size() * sizeof(T), begin * sizeof(T));
+        }
+        return window[index - begin];
+    }
+};
+
+// The windows of one simulation over a spilled trace (each run reads through its own)
+struct trace_reader
+{
+    spill_window<instruction> instructions;
+    spill_window<fork_block> forks;
+
+    trace_reader(const spilled_trace &spilled) : instructions{spilled.instructions.get(), spilled.instruction_count, {}},
+                                                 forks{spilled.forks.get(), spilled.fork_count, {}} {}
+};
+
+// Kind of an event. Fields used (besides time, duration and PID) are noted after each kind.
+enum class event_kind : uint8_t
+{
+    // sequential simulation, one per execution log line
+    CPU_BURST,
+    SYSCALL_KERNEL_MODE, // the SYSCALL handler's "Switch to kernel mode"
+    KERNEL_MODE,
+    CONTEXT_SAVED,
+    FIND_VECTOR,          // number: vector
+    FIND_VECTOR_POSITION, // number: vector
+    LOAD_ADDRESS,         // number: vector
+    OBTAIN_ISR_ADDRESS,
+    CALL_DEVICE_DRIVER,
+    PERFORM_DEVICE_CHECK,
+    SEND_DEVICE_INSTRUCTION,
+    STORE_INFORMATION,
+    RESET_IO,
+    SEND_STANDBY_INSTRUCTION,
+    IRET,
+    CLONE_PCB,
+    FORK_FAILED,
+    SCHEDULER_CALLED,
+    PROGRAM_SIZE, // number: program size
+    EXEC_FAILED,  // name: program
+    LOAD_PROGRAM,
+    MARK_PARTITION,
+    UPDATE_PCB,
+    ISR_STEP, // name: text of the step (--isr)
+    PAGE_FAULT, // number: page (--paging on)
+    SET_UP_PAGE_TABLE,
+
+    // scheduling mode, tagged with a core
+    CORE_CPU_BURST,
+    CORE_SYSCALL,      // number: device
+    CORE_END_IO,       // number: device
+    CORE_FORK,         // number: child PID
+    CORE_FORK_WAITING,
+    CORE_FORK_FAILED,
+    CORE_EXEC,         // name: program, partition
+    CORE_EXEC_WAITING, // name: program
+    CORE_EXEC_FAILED,  // name: program
+    CORE_TERMINATED,
+    CORE_PREEMPTED,
+    CORE_IO_STARTED,   // number: device
+    CORE_IO_DONE,      // number: device (not on a core)
+    CORE_INTERRUPT,    // name: interrupt type (--isr), number: operand
+    CORE_DISPATCHED,
+
+    // partition table (not rendered, for the snapshot store)
+    PARTITION_TAKEN, // partition
+    PARTITION_FREED, // partition
+
+    // system status snapshot: the instruction, then one row per process
+    STATUS_FORK, // number: operand
+    STATUS_EXEC, // name: program, number: operand
+    ROW_RUNNING, // name: program, partition, number: size
+    ROW_READY,
+    ROW_WAITING
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Interrupt handlers as data: each handler is an ordered list of steps, each step an event with a
+// fixed or derived cost. The built-in handlers are the constexpr tables below; --isr loads a file
+// that redefines SYSCALL and END_IO or adds new interrupt types to the trace language.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Where the time of an ISR step comes from
+enum class step_cost : uint8_t
+{
+    FIXED,        // value ms
+    OPERAND,      // the trace line's operand, in ms
+    PER_MB,       // value ms for every Mb of the program (EXEC)
+    DELAY_RANDOM, // a random part of what is left of the device delay (delays[operand]), minus value
+    DELAY_REST,   // what is left of the device delay
+    SNAPSHOT      // takes no time: records the system status snapshot (FORK/EXEC)
+};
+
+#define LOGGED_TIME -1    //!< advance of a step that takes the time it logs
+#define NUMBER_OPERAND -1 //!< event number of a step: the trace line's operand
+#define NUMBER_SIZE -2    //!< event number of a step: the program size (EXEC)
+
+struct isr_step
+{
+    event_kind event;
+    step_cost cost;
+    int value = 0;
+    int number = 0;            // event number: a vector, NUMBER_OPERAND or NUMBER_SIZE
+    int advance = LOGGED_TIME; // time the step takes, if it is not the time it logs
+    bool frame_time = false;   // stamped with the time its frame started (the SYSCALL entry lines)
+    uint32_t message = 0;      // ISR_STEP: index of the line's text in the handler table
+};
+
+// The interrupt boilerplate of FORK (vector 2) and EXEC (vector 3)
+#define ISR_BOILERPLATE(vector)                                           \
+    {event_kind::KERNEL_MODE, step_cost::FIXED, 1},                       \
+        {event_kind::CONTEXT_SAVED, step_cost::FIXED, 10},                \
+        {event_kind::FIND_VECTOR_POSITION, step_cost::FIXED, 1, vector},  \
+        {event_kind::LOAD_ADDRESS, step_cost::FIXED, 1, vector}
+
+constexpr isr_step SYSCALL_STEPS[] = {
+    {event_kind::SYSCALL_KERNEL_MODE, step_cost::FIXED, 1, 0, LOGGED_TIME, true},
+    {event_kind::CONTEXT_SAVED, step_cost::FIXED, 4, 0, LOGGED_TIME, true},
+    {event_kind::FIND_VECTOR, step_cost::FIXED, 1, NUMBER_OPERAND, LOGGED_TIME, true},
+    {event_kind::OBTAIN_ISR_ADDRESS, step_cost::FIXED, 1, 0, LOGGED_TIME, true},
+    {event_kind::CALL_DEVICE_DRIVER, step_cost::DELAY_RANDOM, 2},
+    {event_kind::PERFORM_DEVICE_CHECK, step_cost::DELAY_RANDOM, 1},
+    {event_kind::SEND_DEVICE_INSTRUCTION, step_cost::DELAY_REST},
+    {event_kind::IRET, step_cost::FIXED, 1}};
+
+constexpr isr_step END_IO_STEPS[] = {
+    {event_kind::KERNEL_MODE, step_cost::FIXED, 1},
+    {event_kind::CONTEXT_SAVED, step_cost::FIXED, 4},
+    {event_kind::FIND_VECTOR, step_cost::FIXED, 1, NUMBER_OPERAND},
+    {event_kind::STORE_INFORMATION, step_cost::DELAY_RANDOM, 2},
+    {event_kind::RESET_IO, step_cost::DELAY_RANDOM, 1},
+    {event_kind::SEND_STANDBY_INSTRUCTION, step_cost::DELAY_REST},
+    {event_kind::IRET, step_cost::FIXED, 1}};
+
+// FORK: the entry steps, then the child gets a partition (success) or not (failure)
+constexpr isr_step FORK_STEPS[] = {
+    ISR_BOILERPLATE(2),
+    {event_kind::CLONE_PCB, step_cost::OPERAND}};
+constexpr isr_step FORK_SUCCESS_STEPS[] = {
+    {event_kind::SCHEDULER_CALLED, step_cost::FIXED, 0, 0, 1},
+    {event_kind::SCHEDULER_CALLED, step_cost::SNAPSHOT},
+    {event_kind::IRET, step_cost::FIXED, 1, 0, 0}};
+constexpr isr_step FORK_FAILURE_STEPS[] = {
+    {event_kind::FORK_FAILED, step_cost::FIXED, 0},
+    {event_kind::IRET, step_cost::FIXED, 1}};
+
+// EXEC: the entry steps (after the old image is freed), then the program is loaded or not
+constexpr isr_step EXEC_STEPS[] = {
+    ISR_BOILERPLATE(3),
+    {event_kind::PROGRAM_SIZE, step_cost::OPERAND, 0, NUMBER_SIZE}};
+constexpr isr_step EXEC_SUCCESS_STEPS[] = {
+    {event_kind::LOAD_PROGRAM, step_cost::PER_MB, 15},
+    {event_kind::MARK_PARTITION, step_cost::FIXED, 3},
+    {event_kind::UPDATE_PCB, step_cost::FIXED, 6},
+    {event_kind::SCHEDULER_CALLED, step_cost::FIXED, 0},
+    {event_kind::IRET, step_cost::FIXED, 1},
+    {event_kind::SCHEDULER_CALLED, step_cost::SNAPSHOT}};
+constexpr isr_step EXEC_FAILURE_STEPS[] = {
+    {event_kind::EXEC_FAILED, step_cost::FIXED, 0},
+    {event_kind::SCHEDULER_CALLED, step_cost::SNAPSHOT}};
+
+// EXEC with --paging on: nothing is loaded, the pages are loaded as the program runs them
+constexpr isr_step EXEC_PAGED_STEPS[] = {
+    {event_kind::SET_UP_PAGE_TABLE, step_cost::FIXED, 3},
+    {event_kind::UPDATE_PCB, step_cost::FIXED, 6},
+    {event_kind::SCHEDULER_CALLED, step_cost::FIXED, 0},
+    {event_kind::IRET, step_cost::FIXED, 1},
+    {event_kind::SCHEDULER_CALLED, step_cost::SNAPSHOT}};
+
+// Page fault (--paging on): the page (the operand) is loaded at the rate of EXEC, per Mb of the page
+constexpr isr_step PAGE_FAULT_STEPS[] = {
+    {event_kind::KERNEL_MODE, step_cost::FIXED, 1},
+    {event_kind::CONTEXT_SAVED, step_cost::FIXED, 10},
+    {event_kind::PAGE_FAULT, step_cost::PER_MB, 15, NUMBER_OPERAND},
+    {event_kind::IRET, step_cost::FIXED, 1}};
+
+struct isr_handler
+{
+    std::string name;
+    std::vector<isr_step> entry;   // all of the steps of an interrupt without an action
+    std::vector<isr_step> success; // FORK/EXEC: after the partition was allocated
+    std::vector<isr_step> failure; // FORK/EXEC: when it could not be
+    std::vector<isr_step> paged;   // EXEC with --paging on, instead of success
+    bool uses_delay = false;       // the entry steps take the device delay
+};
+
+// Handlers indexed by opcode (only SYSCALL, END_IO, FORK and EXEC have one), then the interrupt
+// types of the --isr file (opcode::INTERRUPT, whose 'program' is the handler index)
+struct isr_table
+{
+    std::vector<isr_handler> handlers;
+    std::vector<std::string> messages; // text of the ISR_STEP steps
+    std::vector<isr_step> page_fault;  // --paging on: an instruction on a page not in memory
+
+    // The handler of a trace line
+    const isr_handler &of(const instruction &line) const
+    {
+        return handlers[line.op == opcode::INTERRUPT ? line.program : static_cast<unsigned int>(line.op)];
+    }
+};
+
+template <std::size_t N>
+std::vector<isr_step> steps_of(const isr_step (&steps)[N])
+{
+    return std::vector<isr_step>(steps, steps + N);
+}
+
+// Returns true if some step takes (part of) the device delay
+bool uses_delay(const std::vector<isr_step> &steps)
+{
+    return std::any_of(steps.begin(), steps.end(), [](const isr_step &step)
+                       { return step.cost == step_cost::DELAY_RANDOM || step.cost == step_cost::DELAY_REST; });
+}
+
+isr_table builtin_isr_table()
+{
+    isr_table table;
+    table.handlers.resize(OPCODE_COUNT);
+    for (std::size_t op = 0; op < OPCODE_COUNT; op++)
+    {
+        table.handlers[op].name = OPCODE_NAMES[op];
+    }
+    table.handlers[static_cast<int>(opcode::SYSCALL)].entry = steps_of(SYSCALL_STEPS);
+    table.handlers[static_cast<int>(opcode::END_IO)].entry = steps_of(END_IO_STEPS);
+    table.handlers[static_cast<int>(opcode::FORK)] = {"FORK", steps_of(FORK_STEPS), steps_of(FORK_SUCCESS_STEPS), steps_of(FORK_FAILURE_STEPS), {}};
+    table.handlers[static_cast<int>(opcode::EXEC)] = {"EXEC", steps_of(EXEC_STEPS), steps_of(EXEC_SUCCESS_STEPS), steps_of(EXEC_FAILURE_STEPS),
+                                                      steps_of(EXEC_PAGED_STEPS)};
+    table.page_fault = steps_of(PAGE_FAULT_STEPS);
+    for (auto &handler : table.handlers)
+    {
+        handler.uses_delay = uses_delay(handler.entry);
+    }
+    return table;
+}
+
+// Time a list of steps takes (its DELAY_ steps add up to 'delay'), for the scheduling mode
+int isr_cost(const std::vector<isr_step> &steps, int operand, unsigned int size, int delay)
+{
+    int total = 0;
+    bool delayed = false;
+    for (const auto &step : steps)
+    {
+        if (step.advance != LOGGED_TIME)
+        {
+            total += step.advance;
+        }
+        else if (step.cost == step_cost::FIXED)
+        {
+            total += step.value;
+        }
+        else if (step.cost == step_cost::OPERAND)
+        {
+            total += operand;
+        }
+        else if (step.cost == step_cost::PER_MB)
+        {
+            total += step.value * size;
+        }
+        else if (step.cost == step_cost::DELAY_RANDOM || step.cost == step_cost::DELAY_REST)
+        {
+            delayed = true;
+        }
+    }
+    return total + (delayed ? delay : 0);
+}
+
+/**
+ * \brief load interrupt handler definitions
+ *
+ * One step per line: "<INTERRUPT>, <text of the log line>, <cost>", where the cost is a number of
+ * ms, "operand" (the trace line's operand), "delay-<k>" (a random part of what is left of the
+ * device delay of delays[operand], minus k) or "delay" (what is left of it; it must follow the
+ * delay-<k> steps). The steps of an interrupt run in file order. SYSCALL and END_IO replace the
+ * built-in handlers; any other new name becomes a trace activity ("<INTERRUPT>, <operand>").
+ * Empty lines and lines starting with '#' are skipped. Throws std::runtime_error on a bad line.
+ *
+ * @param table the handler table to extend
+ * @param filename the definition file
+ *
+ */
+void load_isr_table(isr_table &table, const std::string &filename)
+{
+    std::ifstream input_file(filename);
+    if (!input_file.is_open())
+    {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+
+    std::vector<bool> redefined(table.handlers.size(), false);
+    std::string line;
+    for (int line_number = 1; std::getline(input_file, line); line_number++)
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        auto fail = [&](const std::string &why)
+        {
+            throw std::runtime_error(filename + ":" + std::to_string(line_number) + ": " + why);
+        };
+
+        auto fields = split_delim(line, ",");
+        if (fields.size() != 3)
+        {
+            fail("Expected <interrupt>, <text>, <cost>");
+        }
+        for (auto &field : fields)
+        {
+            field.erase(0, field.find_first_not_of(' '));
+            field.erase(field.find_last_not_of(' ') + 1);
+        }
+
+        // the handler: a redefined built-in, or a new interrupt type
+        std::size_t id = 0;
+        while (id < table.handlers.size() && table.handlers[id].name != fields[0])
+        {
+            id++;
+        }
+        if (id < OPCODE_COUNT && id != static_cast<std::size_t>(opcode::SYSCALL) && id != static_cast<std::size_t>(opcode::END_IO))
+        {
+            fail("Only SYSCALL, END_IO and new interrupts can be defined: " + fields[0]);
+        }
+        if (fields[0].empty() || fields[0].find(' ') != std::string::npos)
+        {
+            fail("Bad interrupt name: " + fields[0]);
+        }
+        if (id == table.handlers.size())
+        {
+            table.handlers.push_back({fields[0], {}, {}, {}, {}});
+            redefined.push_back(true);
+        }
+        isr_handler &handler = table.handlers[id];
+        if (!redefined[id])
+        {
+            handler.entry.clear(); // the file's steps replace the built-in ones
+            redefined[id] = true;
+        }
+
+        isr_step step = {event_kind::ISR_STEP, step_cost::FIXED};
+        const std::string &cost = fields[2];
+        if (cost == "operand")
+        {
+            step.cost = step_cost::OPERAND;
+        }
+        else if (cost == "delay")
+        {
+            step.cost = step_cost::DELAY_REST;
+        }
+        else
+        {
+            const bool random = cost.compare(0, 6, "delay-") == 0;
+            const char *begin = cost.c_str() + (random ? 6 : 0);
+            auto [end, error] = std::from_chars(begin, cost.c_str() + cost.size(), step.value);
+            if (error != std::errc() || end != cost.c_str() + cost.size() || step.value < 0)
+            {
+                fail("Bad cost: " + cost);
+            }
+            step.cost = random ? step_cost::DELAY_RANDOM : step_cost::FIXED;
+        }
+
+        step.message = table.messages.size();
+        table.messages.push_back(fields[1]);
+        handler.entry.push_back(step);
+    }
+
+    // The random parts of a delay must be followed by the rest of it, or its total would be random
+    for (auto &handler : table.handlers)
+    {
+        bool open_delay = false;
+        for (const auto &step : handler.entry)
+        {
+            if (step.cost == step_cost::DELAY_RANDOM)
+                open_delay = true;
+            else if (step.cost == step_cost::DELAY_REST)
+                open_delay = false;
+        }
+        if (open_delay)
+        {
+            throw std::runtime_error(filename + ": " + handler.name + ": the delay-<k> steps must be followed by a delay step");
+        }
+        handler.uses_delay = uses_delay(handler.entry);
+    }
+}
+
+// Policies of the scheduling mode (--cpus)
+enum class schedule_policy
+{
+    FCFS,        // first come, first served; a process keeps its core until it ends or blocks
+    ROUND_ROBIN, // FCFS order, but a process gives up its core after a time quantum
+    PRIORITY     // lowest priority value first, preempting at instruction boundaries
+};
+
+// Read-only tables of a simulation. Built once in main (by parse_args) and shared by const
+// reference with every handler, so no table is copied while simulating.
+struct simulation_context
+{
+    std::vector<unsigned int> vectors;         // ISR address of each vector
+    std::vector<int> delays;                   // delay of each device
+    std::vector<external_file> external_files; // programs that can be EXECed
+    program_registry programs;                 // the same programs, indexed and pre-loaded
+    compiled_trace trace;                      // the trace to simulate (empty with --stream on)
+    spilled_trace spilled;                     // the trace to simulate, with --stream on
+    isr_table isr = builtin_isr_table();       // interrupt handlers (built-in, or redefined with --isr)
+
+    // options (see parse_option)
+    std::vector<unsigned int> partitions = DEFAULT_PARTITIONS; // partition sizes (partition i + 1 has size partitions[i])
+    fit_policy fit = fit_policy::BEST_FIT;                     // placement policy of the partition allocator
+    unsigned int cpus = 0;                                     // cores of the scheduling mode (0: sequential simulation)
+    schedule_policy policy = schedule_policy::FCFS;            // scheduling policy of the scheduling mode
+    int quantum = 10;                                          // round-robin time quantum
+    bool async_io = false;                                     // scheduling mode: a SYSCALL blocks while its device works
+    unsigned int replicas = 0;                                 // replica mode: number of runs (0: a single run)
+    unsigned int seed = std::mt19937::default_seed;            // seed of the first replica (replica r uses seed + r)
+    unsigned int jitter = 0;                                   // replica mode: each replica draws its device delays within +/- jitter %
+    unsigned int jobs = 0;                                     // worker threads of the batch/replica modes and of --parallel-forks (0: one per hardware thread)
+    bool text = true;                                          // render execution.txt and system_status.txt
+    bool stream = false;                                       // compile the trace to temporary files and run it from there
+    bool parallel_forks = false;                               // run a parent's code after FORK on another thread, speculatively
+    bool paging = false;                                       // demand-paged memory instead of the partition table (sequential mode)
+    unsigned int frame_count = 25;                             // frames of the paged memory
+    unsigned int frame_size = 4;                               // their size, in Mb
+    replacement_policy replacement = replacement_policy::FIFO; // page replacement policy of the paged memory
+    std::string events_file;                                   // binary event file to write (empty: none)
+    std::string snapshots_file;                                // snapshot store to write (empty: none)
+    std::string stats_file;                                    // JSON run summary to write (empty: none)
+    std::string checkpoint_file;                               // checkpoints to write (empty: none)
+    unsigned int checkpoint_interval = 10000;                  // instructions between two checkpoints
+    std::string resume_file;                                   // checkpoints to resume from (empty: start at time 0)
+};
+
+// Wall-clock time of the host, in seconds
+double host_clock()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Counters of one simulation, exported by --stats. They are plain integer increments on the
+// hot paths; the host clock is only read when host_timing is set.
+struct run_stats
+{
+    uint64_t executed[OPCODE_COUNT] = {}; // trace lines executed, per activity type
+    uint64_t fork_success = 0;
+    uint64_t fork_failed = 0;  // no partition for the child
+    uint64_t exec_success = 0;
+    uint64_t exec_failed = 0;  // no partition for the program
+    uint64_t memory_waits = 0; // allocations that waited for a partition (scheduling mode)
+    std::size_t max_wait_queue = 0;
+    std::size_t max_depth = 0; // deepest FORK nesting (init is at depth 1)
+    uint64_t branches_merged = 0; // --parallel-forks: speculative branches whose results were kept
+    uint64_t branches_rerun = 0;  // ... and those run again serially (partition table conflict)
+    uint64_t page_faults = 0;       // --paging on: pages loaded when an instruction on them ran
+    uint64_t page_replacements = 0; // ... in place of another page
+
+    // EXEC to the first instruction of the program (sequential mode): its loading, or with
+    // --paging on its first page fault
+    uint64_t exec_latencies = 0; // samples
+    long long exec_latency_total = 0;
+    int exec_latency_max = 0;
+
+    // Partition occupancy: the simulated time spent with k partitions in use, for each k
+    unsigned int occupied = 0;
+    unsigned int peak_occupied = 0;
+    int occupied_since = 0;
+    std::vector<long long> time_at_occupancy;
+
+    // Host time, in seconds (only measured if host_timing)
+    bool host_timing = false;
+    double parse_seconds = 0;
+    double simulate_seconds = 0;
+    double format_seconds = 0; // rendering the text logs
+    double write_seconds = 0;  // writing the output files
+
+    void count(opcode op) { executed[static_cast<std::size_t>(op)]++; }
+
+    void exec_latency(int latency)
+    {
+        exec_latencies++;
+        exec_latency_total += latency;
+        exec_latency_max = std::max(exec_latency_max, latency);
+    }
+};
+
+// The device delay steps of one handler run in a speculative branch: their draws are made when
+// the branch is merged (see run_isr_steps)
+struct delay_span
+{
+    std::size_t first;     // event of the first step
+    const isr_step *steps; // the steps, from the first delay step to the DELAY_REST
+    std::size_t count;
+    int delay;             // the device delay they split
+    int time;              // time at which the first step started
+};
+
+#define PARALLEL_FORK_MIN 512          //!< trace lines a parent must have left after a FORK to run on another thread
+#define PARALLEL_FORK_MAX_BRANCHES 64  //!< branches kept at once (running, or done and waiting for their child to end)
+#define PARALLEL_FORK_MAX_NESTING 8    //!< branches spawned by a branch spawned by a branch ..., at most
+
+// Worker threads left for speculative branches (--parallel-forks), and the branches kept
+struct fork_pool
+{
+    std::atomic<int> idle;
+    std::atomic<int> branches{0};
+
+    bool take()
+    {
+        if (idle.fetch_sub(1) > 0)
+        {
+            return true;
+        }
+        idle.fetch_add(1);
+        return false;
+    }
+
+    // takes a thread for a new branch, unless none is idle or PARALLEL_FORK_MAX_BRANCHES are kept
+    // (past that, the parents run serially)
+    bool take_branch()
+    {
+        if (branches.fetch_add(1) >= PARALLEL_FORK_MAX_BRANCHES)
+        {
+            branches.fetch_sub(1);
+            return false;
+        }
+        if (!take())
+        {
+            branches.fetch_sub(1);
+            return false;
+        }
+        return true;
+    }
+
+    // a branch was merged or dropped (its thread is released on its own)
+    void drop_branch() { branches.fetch_sub(1); }
+
+    void release() { idle.fetch_add(1); }
+
+    // takes a thread back even if there is none left (a thread that waited for another one)
+    void reclaim() { idle.fetch_sub(1); }
+};
+
+// One simulation over a (shared, read-only) context. A simulator owns all of its mutable state,
+// its partition table, PID counter and random number generator, so several simulators can run
+// at the same time in one process (see the batch mode).
+struct simulator
+{
+    const simulation_context &context;
+    partition_allocator memory; // the partition table
+    page_memory pages;          // the frame table and the page tables (--paging on)
+    unsigned int next_pid;      // PID of the next forked process
+    std::vector<int> delays;    // delay of each device (the context's, or a replica's draw)
+    std::mt19937 rng;           // splits the device delays
+
+    std::vector<std::pair<unsigned int, int>> finish_times; // (PID, time) of each process that ended, in order
+    run_stats stats;
+    std::ofstream *checkpoints = nullptr; // if set, simulate_trace appends its checkpoints to it
+    int resumed_time = -1;                // time of the checkpoint the run resumed from (-1: none)
+
+    // --parallel-forks. A speculative simulator (a branch) does not know the state of the random
+    // number generator yet: it leaves the draws to the merge, and lists the events stamped with
+    // the start of a frame it inherited (their time is not relative to the branch)
+    fork_pool *pool = nullptr;
+    bool speculative = false;
+    std::vector<delay_span> spans;
+    std::vector<std::size_t> fixed_events;
+
+    simulator(const simulation_context &_context, std::mt19937::result_type seed = std::mt19937::default_seed) : context(_context), next_pid(1), delays(_context.delays), rng(seed)
+    {
+        init_memory(memory, context.partitions, context.fit);
+        if (context.paging)
+        {
+            init_pages(pages, context.frame_count, context.frame_size, context.replacement);
+        }
+        stats.time_at_occupancy.assign(memory.partitions.size() + 1, 0);
+        stats.host_timing = !context.stats_file.empty();
+    }
+
+    // Called at 'time' after partitions were allocated or freed: closes the occupancy interval
+    void track_occupancy(int time)
+    {
+        if (time > stats.occupied_since)
+        {
+            stats.time_at_occupancy[stats.occupied] += time - stats.occupied_since;
+            stats.occupied_since = time;
+        }
+        stats.occupied = memory.occupied;
+        stats.peak_occupied = std::max(stats.peak_occupied, stats.occupied);
+    }
+};
+
+// Opens an input file, throws std::runtime_error if it cannot be opened
+void open_input(std::ifstream &input_file, const std::string &filename)
+{
+    input_file.open(filename);
+    if (!input_file.is_open())
+    {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Input tables: each file is mapped into memory as one buffer. Lines and fields are found with
+// memchr (vectorized by the C library) and numbers are parsed in place with std::from_chars, so
+// no line is copied. A malformed line is reported as "<file>:<line>: <what was expected>: <line>".
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A read-only memory map of a whole file, unmapped when it goes out of scope
+struct mapped_file
+{
+    const char *data = nullptr;
+    std::size_t size = 0;
+
+    mapped_file(const std::string &filename)
+    {
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat status;
+        if (fd == -1 || fstat(fd, &status) == -1)
+        {
+            if (fd != -1)
+                ::close(fd);
+            throw std::runtime_error("Unable to open file: " + filename);
+        }
+
+        size = status.st_size;
+        if (size == 0)
+        {
+            ::close(fd);
+            return; // an empty file has no mapping
+        }
+        void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            throw std::runtime_error("Unable to map file: " + filename);
+        }
+        data = static_cast<const char *>(mapping);
+    }
+
+    ~mapped_file()
+    {
+        if (size > 0)
+        {
+            munmap(const_cast<char *>(data), size);
+        }
+    }
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+};
+
+// Walks the lines of a mapped text table
+struct table_reader
+{
+    std::string filename;
+    mapped_file file;
+    const char *next;
+    const char *end;
+    std::size_t line_number = 0;
+    std::string_view line; // the current line, without its "\n" (or "\r\n")
+
+    table_reader(const std::string &_filename) : filename(_filename), file(_filename), next(file.data), end(file.data + file.size) {}
+
+    // Moves to the next line, returns false at the end of the file
+    bool next_line()
+    {
+        if (next == end)
+        {
+            return false;
+        }
+
+        const char *newline = static_cast<const char *>(std::memchr(next, '\n', end - next));
+        const char *line_end = newline != nullptr ? newline : end;
+        line = std::string_view(next, line_end - next);
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+        next = newline != nullptr ? newline + 1 : end;
+        line_number++;
+        return true;
+    }
+
+    [[noreturn]] void fail(const std::string &expected) const
+    {
+        throw std::runtime_error(filename + ":" + std::to_string(line_number) + ": " + expected + ": " + std::string(line));
+    }
+
+    // Parses a field holding one number, blanks around it allowed (and "0X" before a base 16
+    // number), or reports the line as malformed
+    template <typename T>
+    T number(std::string_view field, const std::string &expected, int base = 10) const
+    {
+        while (!field.empty() && (field.front() == ' ' || field.front() == '\t'))
+        {
+            field.remove_prefix(1);
+        }
+        while (!field.empty() && (field.back() == ' ' || field.back() == '\t'))
+        {
+            field.remove_suffix(1);
+        }
+        if (base == 16 && field.size() > 2 && field[0] == '0' && (field[1] == 'X' || field[1] == 'x'))
+        {
+            field.remove_prefix(2);
+        }
+
+        T value{};
+        auto [last, error] = std::from_chars(field.data(), field.data() + field.size(), value, base);
+        if (error != std::errc() || last != field.data() + field.size())
+        {
+            fail(expected);
+        }
+        return value;
+    }
+};
+
+// Reads a table of one number per line (the vector table, the device table, --partitions); a
+// number below 'minimum' is reported as malformed
+template <typename T>
+std::vector<T> load_number_table(const std::string &filename, const std::string &expected, int base = 10,
+                                 T minimum = std::numeric_limits<T>::min())
+{
+    table_reader table(filename);
+    std::vector<T> values;
+    while (table.next_line())
+    {
+        values.push_back(table.number<T>(table.line, expected, base));
+        if (values.back() < minimum)
+        {
+            table.fail(expected);
+        }
+    }
+    return values;
+}
+
+// Reads the external files table, one "<program name>, <size>[, <priority>]" per line
+std::vector<external_file> load_external_files(const std::string &filename)
+{
+    const std::string expected = "Expected <program name>, <size>[, <priority>]";
+    table_reader table(filename);
+    std::vector<external_file> external_files;
+    while (table.next_line())
+    {
+        const std::string_view line = table.line;
+        const char *comma = static_cast<const char *>(std::memchr(line.data(), ',', line.size()));
+        if (comma == nullptr || comma == line.data())
+        {
+            table.fail(expected);
+        }
+
+        external_file entry;
+        entry.program_name.assign(line.data(), comma);
+        std::string_view rest = line.substr(comma - line.data() + 1);
+        const char *second = static_cast<const char *>(std::memchr(rest.data(), ',', rest.size()));
+        if (second == nullptr)
+        {
+            entry.size = table.number<unsigned int>(rest, expected);
+        }
+        else
+        {
+            entry.size = table.number<unsigned int>(rest.substr(0, second - rest.data()), expected);
+            entry.priority = table.number<int>(rest.substr(second - rest.data() + 1), expected);
+        }
+        external_files.push_back(entry);
+    }
+    return external_files;
+}
+
+/**
+ * \brief load the input files of a scenario
+ *
+ * Reads the vector table, the device table and the external files into the context, loads every
+ * program once and compiles the trace (into temporary files with --stream on). Throws
+ * std::runtime_error if a file cannot be read or has a malformed line (with its line number), so
+ * that a batch can go on with its other scenarios.
+ *
+ * @param context the context to fill in (its options are left untouched)
+ * @param trace_file, vector_table, device_table, external_files_table the input files
+ * @param program_dir directory of the program files ("<program_dir><name>.txt")
+ *
+ */
+void load_scenario(simulation_context &context, const std::string &trace_file, const std::string &vector_table, const std::string &device_table, const std::string &external_files_table, const std::string &program_dir)
+{
+    // the trace is opened first (so a missing trace is reported first) and read last
+    std::ifstream trace_input;
+    open_input(trace_input, trace_file);
+
+    context.vectors = load_number_table<unsigned int>(vector_table, "Expected an ISR address (0X01E3)", 16);
+    // (a device delay is split at random between the steps of its handler: it cannot be 0)
+    context.delays = load_number_table<int>(device_table, "Expected a positive device delay", 10, 1);
+    context.external_files = load_external_files(external_files_table);
+
+    // The interrupt types are trace activities
+    for (std::size_t id = OPCODE_COUNT; id < context.isr.handlers.size(); id++)
+    {
+        context.programs.interrupts.emplace(context.isr.handlers[id].name, id);
+    }
+
+    // Load every program once, then compile the trace (which may EXEC any of them)
+    load_programs(context.programs, context.external_files, program_dir);
+
+    if (context.stream)
+        context.spilled = spill_trace(trace_input, context.programs);
+    else
+        context.trace = compile_trace(trace_input, context.programs);
+
+    intern_program(context.programs, INIT_PROGRAM);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Binary scenario files (--convert, --scenario): the vector table, the device delays, the external
+// files, the program registry and the compiled trace packed into one file. The tables are stored
+// in their in-memory layout, so loading is a memory map plus one copy per table, with no parsing.
+//
+// Layout (host byte order, every section starts on an 8-byte boundary):
+//   scenario_header
+//   vectors          uint32_t[vector_count]
+//   delays           int32_t[delay_count]
+//   external files   external_count x { packed_program, name }
+//   programs         program_count  x { packed_program, name, instruction[], fork_block[] }
+//   trace            packed_program (name_length 0), instruction[], fork_block[]
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define SCENARIO_MAGIC "INTRSCN"  //!< first 8 bytes of a binary scenario (with the '\0')
+#define SCENARIO_VERSION 1        //!< bumped whenever the layout changes
+#define SCENARIO_BYTE_ORDER 0x01020304u
+
+struct scenario_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;       // SCENARIO_BYTE_ORDER as written by the converter
+    uint32_t instruction_size; // sizeof(instruction)
+    uint32_t fork_block_size;  // sizeof(fork_block)
+    uint64_t vector_count;
+    uint64_t delay_count;
+    uint64_t external_count;
+    uint64_t program_count;
+};
+
+// Record of an external file, a program or the trace; the name and the tables follow it
+struct packed_program
+{
+    uint32_t size; // UNKNOWN_SIZE for programs missing from the external files
+    int32_t priority;
+    uint64_t name_length;
+    uint64_t instruction_count;
+    uint64_t fork_count;
+};
+
+// Appends raw bytes to a scenario image, padded to the next 8-byte boundary
+void write_section(std::ofstream &output_file, const void *data, std::size_t bytes)
+{
+    static const char padding[8] = {};
+    output_file.write(static_cast<const char *>(data), bytes);
+    output_file.write(padding, (8 - bytes % 8) % 8);
+}
+
+void write_program(std::ofstream &output_file, const std::string &name, unsigned int size, int priority, const compiled_trace &trace)
+{
+    packed_program record = {size, priority, name.size(), trace.instructions.size(), trace.forks.size()};
+    write_section(output_file, &record, sizeof(record));
+    write_section(output_file, name.data(), name.size());
+    write_section(output_file, trace.instructions.data(), trace.instructions.size() * sizeof(instruction));
+    write_section(output_file, trace.forks.data(), trace.forks.size() * sizeof(fork_block));
+}
+
+// Writes the tables of a loaded scenario into a binary scenario file. Throws std::runtime_error
+// if the file cannot be written.
+void save_scenario(const simulation_context &context, const std::string &filename)
+{
+    std::ofstream output_file(filename, std::ios::binary);
+    if (!output_file.is_open())
+    {
+        throw std::runtime_error("Unable to open file: " + filename);
+    }
+
+    scenario_header header = {SCENARIO_MAGIC, SCENARIO_VERSION, SCENARIO_BYTE_ORDER, sizeof(instruction), sizeof(fork_block),
+                              context.vectors.size(), context.delays.size(), context.external_files.size(), context.programs.images.size()};
+    write_section(output_file, &header, sizeof(header));
+
+    std::vector<uint32_t> vectors(context.vectors.begin(), context.vectors.end());
+    std::vector<int32_t> delays(context.delays.begin(), context.delays.end());
+    write_section(output_file, vectors.data(), vectors.size() * sizeof(uint32_t));
+    write_section(output_file, delays.data(), delays.size() * sizeof(int32_t));
+
+    for (const auto &file : context.external_files)
+    {
+        write_program(output_file, file.program_name, file.size, file.priority, compiled_trace());
+    }
+    for (const auto &image : context.programs.images) // in id order, the instructions refer to them by id
+    {
+        write_program(output_file, image.name, image.size, image.priority, image.trace);
+    }
+    write_program(output_file, "", 0, 0, context.trace);
+
+    output_file.close();
+    if (!output_file)
+    {
+        throw std::runtime_error("Unable to write file: " + filename);
+    }
+}
+
+// Walks the sections of a mapped binary file (scenario or events), checking that each one is inside the file
+struct scenario_reader
+{
+    const char *position;
+    const char *end;
+
+    // Returns the next section of 'count' T and skips past its padding
+    template <typename T>
+    const T *section(uint64_t count)
+    {
+        uint64_t bytes = count * sizeof(T);
+        if (count > static_cast<uint64_t>(end - position) / sizeof(T))
+        {
+            throw std::runtime_error("Truncated file");
+        }
+
+        const T *data = reinterpret_cast<const T *>(position);
+        position += std::min<uint64_t>(bytes + (8 - bytes % 8) % 8, end - position);
+        return data;
+    }
+
+    // Reads a program record: returns its name and fills in the trace
+    packed_program program(std::string &name, compiled_trace &trace)
+    {
+        packed_program record = *section<packed_program>(1);
+        const char *name_data = section<char>(record.name_length);
+        name.assign(name_data, record.name_length);
+
+        const instruction *instructions = section<instruction>(record.instruction_count);
+        trace.instructions.assign(instructions, instructions + record.instruction_count);
+        const fork_block *forks = section<fork_block>(record.fork_count);
+        trace.forks.assign(forks, forks + record.fork_count);
+        return record;
+    }
+};
+
+// Loads a binary scenario file written by save_scenario into the context. Throws
+// std::runtime_error if the file cannot be mapped or was written in another format.
+void load_scenario_image(simulation_context &context, const std::string &filename)
+{
+    mapped_file file(filename);
+    scenario_reader reader = {file.data, file.data + file.size};
+
+    const scenario_header header = *reader.section<scenario_header>(1);
+    if (std::memcmp(header.magic, SCENARIO_MAGIC, sizeof(header.magic)) != 0)
+    {
+        throw std::runtime_error("Not a scenario file: " + filename);
+    }
+    if (header.version != SCENARIO_VERSION || header.byte_order != SCENARIO_BYTE_ORDER ||
+        header.instruction_size != sizeof(instruction) || header.fork_block_size != sizeof(fork_block))
+    {
+        throw std::runtime_error("Unsupported scenario file version or layout: " + filename);
+    }
+
+    const uint32_t *vectors = reader.section<uint32_t>(header.vector_count);
+    context.vectors.assign(vectors, vectors + header.vector_count);
+    const int32_t *delays = reader.section<int32_t>(header.delay_count);
+    context.delays.assign(delays, delays + header.delay_count);
+    if (std::any_of(context.delays.begin(), context.delays.end(), [](int delay) { return delay < 1; }))
+    {
+        throw std::runtime_error("Expected a positive device delay in scenario file: " + filename);
+    }
+
+    std::string name;
+    compiled_trace trace;
+    for (uint64_t k = 0; k < header.external_count; k++)
+    {
+        packed_program record = reader.program(name, trace);
+        context.external_files.push_back({name, record.size, record.priority});
+    }
+
+    for (uint64_t id = 0; id < header.program_count; id++)
+    {
+        packed_program record = reader.program(name, trace);
+        context.programs.ids[name] = id;
+        context.programs.images.push_back({name, record.size, std::move(trace), record.priority});
+        trace = compiled_trace();
+    }
+
+    reader.program(name, context.trace);
+    intern_program(context.programs, INIT_PROGRAM); // scenario files saved before it was registered
+
+    // Every EXEC must name a registered program
+    auto check = [&](const compiled_trace &code)
+    {
+        for (const auto &instr : code.instructions)
+        {
+            if ((instr.op == opcode::EXEC && instr.program >= header.program_count) ||
+                (instr.op == opcode::INTERRUPT && instr.program >= context.isr.handlers.size()) ||
+                ((instr.op == opcode::FORK || instr.op == opcode::IF_PARENT) && instr.block != NO_BLOCK && instr.block >= code.forks.size()))
+            {
+                throw std::runtime_error("Corrupt scenario file: " + filename);
+            }
+        }
+    };
+    check(context.trace);
+    for (const auto &image : context.programs.images)
+    {
+        check(image.trace);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Checkpoints (--checkpoint, --resume): the complete state of a sequential simulation, taken every
+// few thousand instructions. A run over an edited trace resumes from the last checkpoint that the
+// edit cannot have changed, instead of starting over from time 0.
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define CHECKPOINT_MAGIC "INTRCKP" //!< first 8 bytes of a checkpoint file (with the '\0')
+#define CHECKPOINT_VERSION 4
+#define TRACE_FILE_PROGRAM 0xFFFFFFFFu //!< program of a frame running the trace file
+
+// State of simulate_trace between two instructions, with the simulator's state
+struct checkpoint
+{
+    int time;
+    unsigned int next_pid;
+    std::size_t last_line;     // every line of the trace file run so far is below last_line
+    uint64_t execution_offset; // bytes of execution.txt written up to here
+    uint64_t status_offset;    // bytes of system_status.txt written up to here
+    std::string rng;           // state of the random number generator (as written by operator<<)
+
+    std::vector<int> occupants;                     // occupant of each partition
+    std::vector<std::vector<unsigned int>> free_lists; // free partitions of each size bucket, in order
+    std::vector<PCB> processes;
+    std::vector<frame> frames; // their traces point into the simulation context
+    std::vector<std::pair<unsigned int, int>> finish_times;
+    run_stats stats; // counters only (the host timings are not kept)
+};
+
+struct checkpoint_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t fingerprint;       // of the scenario without its trace file (see scenario_fingerprint)
+    uint64_t program_count;     // program names, in id order
+    uint64_t instruction_count; // the trace file: its instructions and its FORK blocks
+    uint64_t fork_count;
+    uint32_t text;              // 1 if the run wrote the text logs
+    uint32_t unused;
+};
+
+struct packed_checkpoint
+{
+    int32_t time;
+    uint32_t next_pid;
+    uint64_t last_line;
+    uint64_t execution_offset;
+    uint64_t status_offset;
+    uint64_t rng_length;
+    uint64_t process_count;
+    uint64_t frame_count;
+    uint64_t finish_count;
+};
+
+struct packed_process
+{
+    uint32_t pid;
+    int32_t ppid;
+    uint32_t size;
+    int32_t partition;
+    uint32_t program; // index into the names of the header
+};
+
+struct packed_frame
+{
+    uint32_t program; // program id, or TRACE_FILE_PROGRAM
+    uint32_t process;
+    uint64_t pc;
+    int32_t start_time;
+    uint32_t unused;
+};
+
+struct packed_stats
+{
+    uint64_t executed[OPCODE_COUNT];
+    uint64_t fork_success;
+    uint64_t fork_failed;
+    uint64_t exec_success;
+    uint64_t exec_failed;
+    uint64_t memory_waits;
+    uint64_t max_wait_queue;
+    uint64_t max_depth;
+    uint32_t occupied;
+    uint32_t peak_occupied;
+    int32_t occupied_since;
+    int32_t exec_latency_max;
+    uint64_t exec_latencies;
+    int64_t exec_latency_total;
+};
+
+// FNV-1a hash of some bytes, continuing from 'hash'
+uint64_t fnv1a(uint64_t hash, const void *data, std::size_t bytes)
+{
+    const unsigned char *byte = static_cast<const unsigned char *>(data);
+    for (std::size_t k = 0; k < bytes; k++)
+    {
+        hash = (hash ^ byte[k]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Hashes the instructions of a trace, EXECs by program name (ids depend on the loading order)
+uint64_t hash_trace(uint64_t hash, const compiled_trace &trace, const program_registry &programs)
+{
+    for (const auto &line : trace.instructions)
+    {
+        hash = fnv1a(hash, &line.op, sizeof(line.op));
+        hash = fnv1a(hash, &line.operand, sizeof(line.operand));
+        if (line.op == opcode::EXEC)
+        {
+            const std::string &name = programs.images[line.program].name;
+            hash = fnv1a(hash, name.c_str(), name.size() + 1);
+        }
+    }
+    return hash;
+}
+
+// Hash of everything a sequential run depends on, except the trace file: a checkpoint is only
+// resumed under the same tables, interrupt handlers, programs and partitions.
+uint64_t scenario_fingerprint(const simulation_context &context)
+{
+    uint64_t hash = 14695981039346656037ull;
+    hash = fnv1a(hash, context.vectors.data(), context.vectors.size() * sizeof(unsigned int));
+    hash = fnv1a(hash, context.delays.data(), context.delays.size() * sizeof(int));
+    hash = fnv1a(hash, context.partitions.data(), context.partitions.size() * sizeof(unsigned int));
+    hash = fnv1a(hash, &context.fit, sizeof(context.fit));
+
+    for (const auto &handler : context.isr.handlers)
+    {
+        hash = fnv1a(hash, handler.name.c_str(), handler.name.size() + 1);
+        for (const auto *steps : {&handler.entry, &handler.success, &handler.failure})
+        {
+            for (const auto &step : *steps)
+            {
+                const int fields[] = {static_cast<int>(step.event), static_cast<int>(step.cost), step.value, step.number, step.advance, step.frame_time};
+                hash = fnv1a(hash, fields, sizeof(fields));
+                if (step.event == event_kind::ISR_STEP)
+                {
+                    const std::string &message = context.isr.messages[step.message];
+                    hash = fnv1a(hash, message.c_str(), message.size() + 1);
+                }
+            }
+            hash = fnv1a(hash, "", 1); // end of the list
+        }
+    }
+
+    for (const auto &image : context.programs.images)
+    {
+        if (image.size == UNKNOWN_SIZE && image.trace.instructions.empty())
+        {
+            continue; // a name that no file defines (the trace file may add some)
+        }
+        hash = fnv1a(hash, image.name.c_str(), image.name.size() + 1);
+        hash = fnv1a(hash, &image.size, sizeof(image.size));
+        hash = fnv1a(hash, &image.priority, sizeof(image.priority));
+        hash = hash_trace(hash, image.trace, context.programs);
+    }
+    return hash;
+}
+
+// Starts a checkpoint file: the header, the program names and the trace file it was taken on
+void begin_checkpoint_file(std::ofstream &output_file, const simulation_context &context)
+{
+    const program_registry &programs = context.programs;
+    checkpoint_header header = {CHECKPOINT_MAGIC, CHECKPOINT_VERSION, SCENARIO_BYTE_ORDER, scenario_fingerprint(context),
+                                programs.images.size(), context.trace.instructions.size(), context.trace.forks.size(), context.text, 0};
+    write_section(output_file, &header, sizeof(header));
+
+    for (const auto &image : programs.images)
+    {
+        uint64_t length = image.name.size();
+        write_section(output_file, &length, sizeof(length));
+        write_section(output_file, image.name.data(), image.name.size());
+    }
+    write_section(output_file, context.trace.instructions.data(), context.trace.instructions.size() * sizeof(instruction));
+    write_section(output_file, context.trace.forks.data(), context.trace.forks.size() * sizeof(fork_block));
+}
+
+// Appends a checkpoint to a checkpoint file
+void write_checkpoint(std::ofstream &output_file, const checkpoint &state, const simulation_context &context)
+{
+    packed_checkpoint record = {state.time, state.next_pid, state.last_line, state.execution_offset, state.status_offset,
+                                state.rng.size(), state.processes.size(), state.frames.size(), state.finish_times.size()};
+    write_section(output_file, &record, sizeof(record));
+    write_section(output_file, state.rng.data(), state.rng.size());
+
+    std::vector<int32_t> occupants(state.occupants.begin(), state.occupants.end());
+    write_section(output_file, occupants.data(), occupants.size() * sizeof(int32_t));
+    std::vector<uint32_t> lengths, free_lists; // the length of each list, then the lists
+    for (const auto &list : state.free_lists)
+    {
+        lengths.push_back(list.size());
+        free_lists.insert(free_lists.end(), list.begin(), list.end());
+    }
+    write_section(output_file, lengths.data(), lengths.size() * sizeof(uint32_t));
+    write_section(output_file, free_lists.data(), free_lists.size() * sizeof(uint32_t));
+
+    for (const auto &process : state.processes)
+    {
+        packed_process packed = {process.PID, process.PPID, process.size, process.partition_number, process.program};
+        write_section(output_file, &packed, sizeof(packed));
+    }
+
+    std::vector<packed_frame> frames;
+    for (const auto &level : state.frames)
+    {
+        uint32_t program = TRACE_FILE_PROGRAM;
+        for (std::size_t id = 0; id < context.programs.images.size() && level.trace != &context.trace; id++)
+        {
+            if (level.trace == &context.programs.images[id].trace)
+            {
+                program = id;
+                break;
+            }
+        }
+        frames.push_back({program, level.process, level.pc, level.start_time, 0});
+    }
+    write_section(output_file, frames.data(), frames.size() * sizeof(packed_frame));
+
+    std::vector<int32_t> finish_times;
+    for (const auto &[pid, time] : state.finish_times)
+    {
+        finish_times.push_back(pid);
+        finish_times.push_back(time);
+    }
+    write_section(output_file, finish_times.data(), finish_times.size() * sizeof(int32_t));
+
+    const run_stats &stats = state.stats;
+    packed_stats counters = {{}, stats.fork_success, stats.fork_failed, stats.exec_success, stats.exec_failed, stats.memory_waits,
+                             stats.max_wait_queue, stats.max_depth, stats.occupied, stats.peak_occupied, stats.occupied_since,
+                             stats.exec_latency_max, stats.exec_latencies, stats.exec_latency_total};
+    std::copy(stats.executed, stats.executed + OPCODE_COUNT, counters.executed);
+    write_section(output_file, &counters, sizeof(counters));
+    write_section(output_file, stats.time_at_occupancy.data(), stats.time_at_occupancy.size() * sizeof(long long));
+}
+
+// The checkpoints of a file, checked against the scenario they are resumed under
+struct checkpoint_store
+{
+    bool text;                 // the checkpointed run wrote the text logs
+    std::size_t first_changed; // first instruction of the trace file that differs from the checkpointed run's
+    std::vector<checkpoint> checkpoints;
+};
+
+/**
+ * \brief read a checkpoint file for a run of 'context'
+ *
+ * Throws std::runtime_error if the file cannot be read, or was taken under other tables,
+ * programs or partitions than the context's (only the trace file may change).
+ *
+ * @param filename the checkpoint file
+ * @param context the scenario to resume: the frames of the checkpoints point into it
+ * @return the checkpoints, and the first line of the trace file that changed since they were taken
+ *
+ */
+checkpoint_store load_checkpoints(const std::string &filename, const simulation_context &context)
+{
+    mapped_file file(filename);
+    scenario_reader reader = {file.data, file.data + file.size};
+
+    const checkpoint_header header = *reader.section<checkpoint_header>(1);
+    if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0)
+    {
+        throw std::runtime_error("Not a checkpoint file: " + filename);
+    }
+    if (header.version != CHECKPOINT_VERSION || header.byte_order != SCENARIO_BYTE_ORDER)
+    {
+        throw std::runtime_error("Unsupported checkpoint file version or layout: " + filename);
+    }
+    if (header.fingerprint != scenario_fingerprint(context))
+    {
+        throw std::runtime_error("The checkpoints were taken on other input files: " + filename);
+    }
+
+    // program ids of the checkpointed run, mapped to the ids of this one
+    std::vector<std::string> names;
+    std::vector<unsigned int> program_ids;
+    for (uint64_t id = 0; id < header.program_count; id++)
+    {
+        uint64_t length = *reader.section<uint64_t>(1);
+        names.emplace_back(reader.section<char>(length), length);
+        auto found = context.programs.ids.find(names.back());
+        program_ids.push_back(found != context.programs.ids.end() ? found->second : TRACE_FILE_PROGRAM);
+    }
+
+    // The trace file is compared instruction by instruction (EXECs by program name). A FORK or
+    // IF_PARENT whose block moved (an IF_PARENT or ENDIF was edited) counts as changed too.
+    const instruction *old_trace = reader.section<instruction>(header.instruction_count);
+    const fork_block *old_forks = reader.section<fork_block>(header.fork_count);
+    const compiled_trace &trace = context.trace;
+    checkpoint_store store = {header.text != 0, 0, {}};
+    for (; store.first_changed < header.instruction_count && store.first_changed < trace.instructions.size(); store.first_changed++)
+    {
+        const instruction &before = old_trace[store.first_changed];
+        const instruction &after = trace.instructions[store.first_changed];
+        if (before.op != after.op || before.operand != after.operand ||
+            (before.op == opcode::EXEC && (before.program >= names.size() || names[before.program] != context.programs.images[after.program].name)))
+        {
+            break;
+        }
+        if ((before.op == opcode::FORK || before.op == opcode::IF_PARENT) && (before.block == NO_BLOCK) != (after.block == NO_BLOCK))
+        {
+            break;
+        }
+        if ((before.op == opcode::FORK || before.op == opcode::IF_PARENT) && before.block != NO_BLOCK)
+        {
+            if (before.block >= header.fork_count)
+            {
+                throw std::runtime_error("Corrupt checkpoint file: " + filename);
+            }
+            const fork_block &old_block = old_forks[before.block], &block = trace.forks[after.block];
+            if (old_block.child_begin != block.child_begin || old_block.child_end != block.child_end || old_block.parent_begin != block.parent_begin ||
+                old_block.parent_end != block.parent_end || old_block.post_begin != block.post_begin)
+            {
+                break;
+            }
+        }
+    }
+
+    const std::size_t bucket_count = [&]()
+    {
+        std::vector<unsigned int> sizes = context.partitions;
+        std::sort(sizes.begin(), sizes.end());
+        return std::unique(sizes.begin(), sizes.end()) - sizes.begin();
+    }();
+
+    while (reader.position < reader.end)
+    {
+        const packed_checkpoint record = *reader.section<packed_checkpoint>(1);
+        checkpoint state;
+        state.time = record.time;
+        state.next_pid = record.next_pid;
+        state.last_line = record.last_line;
+        state.execution_offset = record.execution_offset;
+        state.status_offset = record.status_offset;
+        state.rng.assign(reader.section<char>(record.rng_length), record.rng_length);
+
+        const int32_t *occupants = reader.section<int32_t>(context.partitions.size());
+        state.occupants.assign(occupants, occupants + context.partitions.size());
+
+        const uint32_t *lengths = reader.section<uint32_t>(bucket_count);
+        const uint64_t listed = std::accumulate(lengths, lengths + bucket_count, uint64_t(0));
+        const uint32_t *list = reader.section<uint32_t>(listed);
+        for (std::size_t bucket = 0; bucket < bucket_count; list += lengths[bucket++])
+        {
+            state.free_lists.emplace_back(list, list + lengths[bucket]);
+        }
+        for (const auto &free_list : state.free_lists)
+        {
+            for (unsigned int index : free_list)
+            {
+                if (index >= context.partitions.size() || state.occupants[index] != -1)
+                {
+                    throw std::runtime_error("Corrupt checkpoint file: " + filename);
+                }
+            }
+        }
+
+        for (uint64_t k = 0; k < record.process_count; k++)
+        {
+            const packed_process process = *reader.section<packed_process>(1);
+            if (process.program >= program_ids.size())
+            {
+                throw std::runtime_error("Corrupt checkpoint file: " + filename);
+            }
+            if (program_ids[process.program] == TRACE_FILE_PROGRAM)
+            {
+                state.last_line = SIZE_MAX; // runs a program the scenario no longer has: never resumable
+            }
+            state.processes.emplace_back(process.pid, process.ppid, program_ids[process.program], process.size, process.partition);
+        }
+
+        const packed_frame *frames = reader.section<packed_frame>(record.frame_count);
+        for (uint64_t k = 0; k < record.frame_count; k++)
+        {
+            const packed_frame &level = frames[k];
+            const compiled_trace *code = &context.trace;
+            if (level.program != TRACE_FILE_PROGRAM)
+            {
+                if (level.program >= program_ids.size() || program_ids[level.program] == TRACE_FILE_PROGRAM)
+                {
+                    throw std::runtime_error("Corrupt checkpoint file: " + filename);
+                }
+                code = &context.programs.images[program_ids[level.program]].trace;
+            }
+            if (level.process >= record.process_count || level.pc > code->instructions.size())
+            {
+                throw std::runtime_error("Corrupt checkpoint file: " + filename);
+            }
+            state.frames.push_back({code, level.pc, level.process, level.start_time});
+        }
+
+        const int32_t *finish_times = reader.section<int32_t>(2 * record.finish_count);
+        for (uint64_t k = 0; k < record.finish_count; k++)
+        {
+            state.finish_times.emplace_back(finish_times[2 * k], finish_times[2 * k + 1]);
+        }
+
+        const packed_stats counters = *reader.section<packed_stats>(1);
+        run_stats &stats = state.stats;
+        std::copy(counters.executed, counters.executed + OPCODE_COUNT, stats.executed);
+        stats.fork_success = counters.fork_success;
+        stats.fork_failed = counters.fork_failed;
+        stats.exec_success = counters.exec_success;
+        stats.exec_failed = counters.exec_failed;
+        stats.memory_waits = counters.memory_waits;
+        stats.max_wait_queue = counters.max_wait_queue;
+        stats.max_depth = counters.max_depth;
+        stats.occupied = counters.occupied;
+        stats.peak_occupied = counters.peak_occupied;
+        stats.occupied_since = counters.occupied_since;
+        stats.exec_latency_max = counters.exec_latency_max;
+        stats.exec_latencies = counters.exec_latencies;
+        stats.exec_latency_total = counters.exec_latency_total;
+        const long long *occupancy = reader.section<long long>(context.partitions.size() + 1);
+        stats.time_at_occupancy.assign(occupancy, occupancy + context.partitions.size() + 1);
+
+        store.checkpoints.push_back(std::move(state));
+    }
+    return store;
+}
+
+// A checkpoint can be resumed if the run up to it did not read the changed part of the trace
+// file, and no frame of the trace file is to go on from past it.
+bool resumable(const checkpoint &state, const compiled_trace &trace, std::size_t first_changed)
+{
+    if (state.last_line > first_changed)
+    {
+        return false;
+    }
+    for (const auto &level : state.frames)
+    {
+        if (level.trace == &trace && level.pc > first_changed)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sets the partition table back to a checkpoint's: the occupants, and the free lists in the same
+// order, so that the same partitions are handed out from there on
+void restore_memory(partition_allocator &memory, const checkpoint &state)
+{
+    memory.occupied = 0;
+    for (std::size_t index = 0; index < memory.partitions.size(); index++)
+    {
+        memory.partitions[index].occupant = state.occupants[index];
+        const bool free = state.occupants[index] == -1;
+        tree_set(memory.by_number, index, free ? std::uint64_t(memory.partitions[index].size) + 1 : 0);
+        memory.occupied += free ? 0 : 1;
+    }
+
+    memory.bucket_free = state.free_lists;
+    for (std::size_t bucket = 0; bucket < memory.bucket_free.size(); bucket++)
+    {
+        const std::vector<unsigned int> &list = memory.bucket_free[bucket];
+        for (std::size_t slot = 0; slot < list.size(); slot++)
+        {
+            memory.free_slot[list[slot]] = slot;
+        }
+        tree_set(memory.by_size, bucket, list.empty() ? 0 : std::uint64_t(memory.bucket_sizes[bucket]) + 1);
+    }
+}
+
+// Prints how to run the program
+void print_usage()
+{
+    std::cout << "To run the program, do: ./interrutps <your_trace_file.txt> <your_vector_table.txt> <your_device_table.txt> <your_external_files.txt> [options]" << std::endl;
+    std::cout << "        or, for a batch: ./interrutps --batch <scenario_directory>... [--jobs <N>] [options]" << std::endl;
+    std::cout << "        or, to pack the input files into a binary scenario: ./interrutps --convert <your_trace_file.txt> <your_vector_table.txt> <your_device_table.txt> <your_external_files.txt> <scenario.bin>" << std::endl;
+    std::cout << "        or, from a binary scenario: ./interrutps --scenario <scenario.bin> [options]" << std::endl;
+    std::cout << "        or, to render the text logs of a binary event log: ./interrutps --render <events.bin>" << std::endl;
+    std::cout << "        or, to query a snapshot store: ./interrutps --query <snapshots.bin> <time> | partition <N> [<from> <to>]" << std::endl;
+    std::cout << "Options: --partitions <your_partition_table.txt>  one partition size per line (default: 40, 25, 15, 10, 8, 2)" << std::endl;
+    std::cout << "         --fit <first|best|worst>                partition placement policy (default: best)" << std::endl;
+    std::cout << "         --cpus <N>                              scheduling mode: N cores with a ready queue (default: off)" << std::endl;
+    std::cout << "         --schedule <fcfs|rr|priority>           scheduling policy (default: fcfs)" << std::endl;
+    std::cout << "         --quantum <ms>                          round-robin time quantum (default: 10)" << std::endl;
+    std::cout << "         --io <inline|async>                     with --cpus; async: a SYSCALL blocks its process while the device works (default: inline)" << std::endl;
+    std::cout << "         --replicas <K>                          run K replicas and write their timing statistics, without logs" << std::endl;
+    std::cout << "         --seed <S>                              random seed of the first replica (default: 5489)" << std::endl;
+    std::cout << "         --jitter <P>                            each replica draws its device delays within +/- P % of the table (default: 0)" << std::endl;
+    std::cout << "         --jobs <N>                              worker threads of a batch, of the replicas or of --parallel-forks (default: all)" << std::endl;
+    std::cout << "         --text <on|off>                         render execution.txt and system_status.txt (default: on)" << std::endl;
+    std::cout << "         --events <events.bin>                   also write the binary event log (in each directory of a batch)" << std::endl;
+    std::cout << "         --snapshots <snapshots.bin>             also write the system status snapshots indexed by time, for --query" << std::endl;
+    std::cout << "         --stream <on|off>                       run the trace from temporary files, for traces larger than memory (sequential mode)" << std::endl;
+    std::cout << "         --parallel-forks <on|off>               run a parent's code after FORK on another thread while its child runs (sequential mode, --jobs threads)" << std::endl;
+    std::cout << "         --paging <on|off>                       load programs page by page, on first use, into fixed-size frames (sequential mode)" << std::endl;
+    std::cout << "         --frames <N>                            frames of the paged memory (default: 25)" << std::endl;
+    std::cout << "         --frame-size <Mb>                       size of a frame (default: 4)" << std::endl;
+    std::cout << "         --replacement <fifo|lru|clock>          page replacement policy (default: fifo)" << std::endl;
+    std::cout << "         --isr <isr_table.txt>                   interrupt handler steps: redefine SYSCALL/END_IO, add interrupt types" << std::endl;
+    std::cout << "         --stats <stats.json>                    write the run's counters and host timings as JSON" << std::endl;
+    std::cout << "         --checkpoint <checkpoints.bin>          save the simulation state periodically (sequential mode)" << std::endl;
+    std::cout << "         --checkpoint-every <N>                  instructions between two checkpoints (default: 10000)" << std::endl;
+    std::cout << "         --resume <checkpoints.bin>              resume from the last checkpoint before the first edited trace line" << std::endl;
+}
+
+// Parses a command line argument holding one number, or throws naming what was expected
+template <typename T>
+T number_argument(std::string_view argument, const std::string &expected)
+{
+    T value{};
+    auto [last, error] = std::from_chars(argument.data(), argument.data() + argument.size(), value);
+    if (argument.empty() || error != std::errc() || last != argument.data() + argument.size())
+    {
+        throw std::runtime_error(expected + ", received " + std::string(argument));
+    }
+    return value;
+}
+
+#define MAX_CPUS 1024 //!< cores of the scheduling mode, at most
+
+/**
+ * \brief parse the value of a numeric option
+ *
+ * @param option the option
+ * @param argument its value
+ * @param expected what the value must be, for the error message
+ * @param minimum smallest accepted value
+ * @param maximum largest accepted value
+ * @return the value; exits with an error if it is not a number between minimum and maximum
+ *
+ */
+template <typename T>
+T option_number(const std::string &option, const char *argument, const std::string &expected,
+                T minimum = std::numeric_limits<T>::min(), T maximum = std::numeric_limits<T>::max())
+{
+    try
+    {
+        const T value = number_argument<T>(argument, expected + " after " + option);
+        if (value >= minimum && value <= maximum)
+        {
+            return value;
+        }
+    }
+    catch (const std::runtime_error &)
+    {
+        // not a number: reported below, like a number out of range
+    }
+    std::cerr << "Error: " << expected << " after " << option << ", received " << argument << std::endl;
+    exit(1);
+}
+
+/**
+ * \brief parse one simulation option
+ *
+ * @param argc number of command line arguments
+ * @param argv the command line arguments
+ * @param i index of the option
+ * @param context the context that receives the option
+ * @return the index of the option's last argument, or -1 if argv[i] is not a simulation option
+ *
+ */
+int parse_option(int argc, char **argv, int i, simulation_context &context)
+{
+    std::string option = argv[i];
+    if (i + 1 >= argc)
+    {
+        return -1; // every option takes a value
+    }
+
+    if (option == "--partitions")
+    {
+        try
+        {
+            context.partitions = load_number_table<unsigned int>(argv[i + 1], "Expected a partition size");
+        }
+        catch (const std::exception &error)
+        {
+            std::cerr << "Error: " << error.what() << std::endl;
+            exit(1);
+        }
+    }
+    else if (option == "--fit")
+    {
+        std::string fit = argv[i + 1];
+        if (fit == "first")
+            context.fit = fit_policy::FIRST_FIT;
+        else if (fit == "best")
+            context.fit = fit_policy::BEST_FIT;
+        else if (fit == "worst")
+            context.fit = fit_policy::WORST_FIT;
+        else
+        {
+            std::cerr << "Error: Unknown fit policy: " << fit << std::endl;
+            exit(1);
+        }
+    }
+    else if (option == "--cpus")
+    {
+        context.cpus = option_number<unsigned int>(option, argv[i + 1], "Expected a number of cores (0 to " + std::to_string(MAX_CPUS) + ")", 0, MAX_CPUS);
+    }
+    else if (option == "--schedule")
+    {
+        std::string policy = argv[i + 1];
+        if (policy == "fcfs")
+            context.policy = schedule_policy::FCFS;
+        else if (policy == "rr")
+            context.policy = schedule_policy::ROUND_ROBIN;
+        else if (policy == "priority")
+            context.policy = schedule_policy::PRIORITY;
+        else
+        {
+            std::cerr << "Error: Unknown scheduling policy: " << policy << std::endl;
+            exit(1);
+        }
+    }
+    else if (option == "--io")
+    {
+        std::string io = argv[i + 1];
+        if (io != "inline" && io != "async")
+        {
+            std::cerr << "Error: Expected inline or async after --io, received " << io << std::endl;
+            exit(1);
+        }
+        context.async_io = io == "async";
+    }
+    else if (option == "--replicas")
+    {
+        context.replicas = option_number<unsigned int>(option, argv[i + 1], "Expected a number of replicas");
+    }
+    else if (option == "--seed")
+    {
+        context.seed = option_number<unsigned int>(option, argv[i + 1], "Expected a seed");
+    }
+    else if (option == "--jitter")
+    {
+        context.jitter = option_number<unsigned int>(option, argv[i + 1], "Expected a percentage (0 to 100)", 0, 100);
+    }
+    else if (option == "--jobs")
+    {
+        context.jobs = option_number<unsigned int>(option, argv[i + 1], "Expected a number of threads");
+    }
+    else if (option == "--text")
+    {
+        std::string text = argv[i + 1];
+        if (text != "on" && text != "off")
+        {
+            std::cerr << "Error: Expected on or off after --text, received " << text << std::endl;
+            exit(1);
+        }
+        context.text = text == "on";
+    }
+    else if (option == "--events")
+    {
+        context.events_file = argv[i + 1];
+    }
+    else if (option == "--snapshots")
+    {
+        context.snapshots_file = argv[i + 1];
+    }
+    else if (option == "--isr")
+    {
+        try
+        {
+            load_isr_table(context.isr, argv[i + 1]);
+        }
+        catch (const std::exception &error)
+        {
+            std::cerr << "Error: " << error.what() << std::endl;
+            exit(1);
+        }
+    }
+    else if (option == "--stream")
+    {
+        std::string stream = argv[i + 1];
+        if (stream != "on" && stream != "off")
+        {
+            std::cerr << "Error: Expected on or off after --stream, received " << stream << std::endl;
+            exit(1);
+        }
+        context.stream = stream == "on";
+    }
+    else if (option == "--parallel-forks")
+    {
+        std::string parallel = argv[i + 1];
+        if (parallel != "on" && parallel != "off")
+        {
+            std::cerr << "Error: Expected on or off after --parallel-forks, received " << parallel << std::endl;
+            exit(1);
+        }
+        context.parallel_forks = parallel == "on";
+    }
+    else if (option == "--paging")
+    {
+        std::string paging = argv[i + 1];
+        if (paging != "on" && paging != "off")
+        {
+            std::cerr << "Error: Expected on or off after --paging, received " << paging << std::endl;
+            exit(1);
+        }
+        context.paging = paging == "on";
+    }
+    else if (option == "--frames" || option == "--frame-size")
+    {
+        unsigned int &value = option == "--frames" ? context.frame_count : context.frame_size;
+        value = option_number<unsigned int>(option, argv[i + 1], "Expected a positive number", 1);
+    }
+    else if (option == "--replacement")
+    {
+        std::string replacement = argv[i + 1];
+        if (replacement == "fifo")
+            context.replacement = replacement_policy::FIFO;
+        else if (replacement == "lru")
+            context.replacement = replacement_policy::LRU;
+        else if (replacement == "clock")
+            context.replacement = replacement_policy::CLOCK;
+        else
+        {
+            std::cerr << "Error: Unknown replacement policy: " << replacement << std::endl;
+            exit(1);
+        }
+    }
+    else if (option == "--stats")
+    {
+        context.stats_file = argv[i + 1];
+    }
+    else if (option == "--checkpoint")
+    {
+        context.checkpoint_file = argv[i + 1];
+    }
+    else if (option == "--checkpoint-every")
+    {
+        context.checkpoint_interval = option_number<unsigned int>(option, argv[i + 1], "Expected a positive number of instructions", 1);
+    }
+    else if (option == "--resume")
+    {
+        context.resume_file = argv[i + 1];
+    }
+    else if (option == "--quantum")
+    {
+        context.quantum = option_number<int>(option, argv[i + 1], "Expected a positive time quantum", 1);
+    }
+    else
+    {
+        return -1;
+    }
+
+    return i + 1;
+}
+
+/**
+ * \brief check that the options of a run can be used together
+ *
+ * Throws std::runtime_error naming the first conflict.
+ *
+ * @param context the options
+ * @param binary whether the run reads a binary scenario (--scenario)
+ *
+ */
+void check_options(const simulation_context &context, bool binary)
+{
+    const bool checkpoints = !context.checkpoint_file.empty() || !context.resume_file.empty();
+    if (binary && context.stream)
+    {
+        throw std::runtime_error("A binary scenario holds a compiled trace, it cannot be streamed");
+    }
+    if (context.cpus > 0 && checkpoints)
+    {
+        throw std::runtime_error("Checkpoints are only taken in the sequential mode");
+    }
+    if (context.stream && (context.cpus > 0 || checkpoints))
+    {
+        throw std::runtime_error("A streamed trace only runs in the sequential mode, without checkpoints");
+    }
+    if (context.parallel_forks && (context.cpus > 0 || context.stream || checkpoints || context.replicas > 0))
+    {
+        throw std::runtime_error("Parallel FORK branches only run in the sequential mode, without --stream, checkpoints or replicas");
+    }
+    if (context.jitter > 0 && context.replicas == 0)
+    {
+        throw std::runtime_error("The delay jitter only applies to replicas (--replicas)");
+    }
+    if (context.paging && (context.cpus > 0 || context.parallel_forks || checkpoints))
+    {
+        throw std::runtime_error("Paging only runs in the sequential mode, without --parallel-forks or checkpoints");
+    }
+}
+
+/**
+ * \brief parse the CLI arguments
+ *
+ * This helper function parses command line arguments and checks for errors
+ *
+ * @param argc number of command line arguments
+ * @param argv the command line arguments
+ * @return the simulation context: the parsed vector table, the device delays, the external files,
+ *         the loaded programs and the compiled trace
+ *
+ */
+simulation_context parse_args(int argc, char **argv)
+{
+    // a binary scenario replaces the four input files
+    const bool binary = argc >= 3 && std::string(argv[1]) == "--scenario";
+    if (argc < 5 && !binary)
+    {
+        std::cout << "ERROR!\nExpected 4 argument, received " << argc - 1 << std::endl;
+        print_usage();
+        exit(1);
+    }
+
+    simulation_context context;
+
+    // Optional arguments come after the input files
+    for (int i = binary ? 3 : 5; i < argc; i++)
+    {
+        int last = parse_option(argc, argv, i, context);
+        if (last == -1)
+        {
+            std::cerr << "Error: Unknown option: " << argv[i] << std::endl;
+            exit(1);
+        }
+        i = last;
+    }
+
+    try
+    {
+        check_options(context, binary);
+        if (binary)
+        {
+            load_scenario_image(context, argv[2]);
+        }
+        else
+        {
+            // program files are looked up in the current directory
+            load_scenario(context, argv[1], argv[2], argv[3], argv[4], "");
+        }
+    }
+    catch (const std::exception &error)
+    {
+        std::cerr << "Error: " << error.what() << std::endl;
+        exit(1);
+    }
+
+    return context;
+}
+
+#define OUTPUT_CHUNK_SIZE (64 * 1024) //!< bytes buffered by an output_sink before they are written
+
+// Two hex digits for every byte value ("00" to "FF"), so addresses are written without sprintf
+struct hex_table
+{
+    char pairs[512];
+
+    constexpr hex_table() : pairs()
+    {
+        const char digits[] = "0123456789ABCDEF";
+        for (int byte = 0; byte < 256; byte++)
+        {
+            pairs[2 * byte] = digits[byte >> 4];
+            pairs[2 * byte + 1] = digits[byte & 15];
+        }
+    }
+};
+
+constexpr hex_table HEX_PAIRS;
+
+// An address written as prefix + at least 4 uppercase hex digits ("0X01E3", like "0X%04X")
+struct hex_address
+{
+    unsigned int value;
+    const char *prefix = "0X";
+};
+
+// Output file shared by reference through the whole simulation. Every line is appended once
+// to a growable buffer, which is written to the file in chunks of OUTPUT_CHUNK_SIZE bytes.
+struct output_sink
+{
+    std::ofstream file;
+    std::string buffer;
+    bool discard = false;           // drops everything (replicas that only keep their timings)
+    double *write_seconds = nullptr; // if set, the time spent writing the file is added to it
+    uint64_t flushed = 0;            // bytes handed to the file so far
+    std::ostream *stream = nullptr;  // if set, written to instead of a file (the standard output)
+
+    // A sink that writes nothing
+    output_sink() : discard(true) {}
+
+    // A sink that writes to a stream (std::cout), which it does not close
+    output_sink(std::ostream &_stream) : stream(&_stream)
+    {
+        buffer.reserve(OUTPUT_CHUNK_SIZE + 256);
+    }
+
+    output_sink(const std::string &filename) : file(filename)
+    {
+        if (!file.is_open())
+        {
+            std::cerr << "Error opening file!" << std::endl;
+        }
+        buffer.reserve(OUTPUT_CHUNK_SIZE + 256);
+    }
+
+    // Reopens a file to append after its first 'keep' bytes (the rest is cut off), for a resumed run
+    output_sink(const std::string &filename, uint64_t keep) : flushed(keep)
+    {
+        struct stat status;
+        if (stat(filename.c_str(), &status) == -1 || uint64_t(status.st_size) < keep || truncate(filename.c_str(), keep) == -1)
+        {
+            std::cerr << "Error: Unable to resume file: " << filename << std::endl;
+        }
+        else
+        {
+            file.open(filename, std::ios::app);
+        }
+        buffer.reserve(OUTPUT_CHUNK_SIZE + 256);
+    }
+
+    // Bytes written to the sink so far (the file's size once flushed)
+    uint64_t offset() const { return flushed + buffer.size(); }
+
+    void append(const std::string &text)
+    {
+        if (discard)
+        {
+            return;
+        }
+        buffer += text;
+        if (buffer.size() >= OUTPUT_CHUNK_SIZE)
+        {
+            flush();
+        }
+    }
+
+    output_sink &operator+=(const std::string &text)
+    {
+        append(text);
+        return *this;
+    }
+
+    // Pieces of a line, written straight into the buffer (integers with std::to_chars)
+    void put(std::string_view text) { buffer.append(text); }
+    void put(char c) { buffer.push_back(c); }
+    void put(const hex_address &address);
+
+    template <typename Integer, typename std::enable_if<std::is_integral<Integer>::value, int>::type = 0>
+    void put(Integer value)
+    {
+        char digits[24];
+        buffer.append(digits, std::to_chars(digits, digits + sizeof(digits), value).ptr);
+    }
+
+    // Right-aligns a piece in a field of 'width' characters (like std::setw)
+    template <typename Piece>
+    void put_padded(const Piece &piece, std::size_t width, char fill = ' ')
+    {
+        std::size_t begin = buffer.size();
+        put(piece);
+        std::size_t length = buffer.size() - begin;
+        if (length < width)
+        {
+            buffer.insert(begin, width - length, fill);
+        }
+    }
+
+    // Appends pieces of text, characters and integers, with no temporary strings
+    template <typename... Pieces>
+    void print(const Pieces &...pieces)
+    {
+        if (discard)
+        {
+            return;
+        }
+        (put(pieces), ...);
+        if (buffer.size() >= OUTPUT_CHUNK_SIZE)
+        {
+            flush();
+        }
+    }
+
+    // Appends an execution log line: "time, duration, message\n"
+    template <typename... Pieces>
+    void log(int time, int duration, const Pieces &...message)
+    {
+        print(time, ", ", duration, ", ", message..., '\n');
+    }
+
+    // Writes the buffered output to the file
+    void flush()
+    {
+        const double start = write_seconds != nullptr ? host_clock() : 0;
+        if (stream != nullptr)
+        {
+            stream->write(buffer.data(), buffer.size());
+        }
+        else if (file.is_open())
+        {
+            file.write(buffer.data(), buffer.size());
+        }
+        flushed += buffer.size();
+        buffer.clear();
+        if (write_seconds != nullptr)
+        {
+            *write_seconds += host_clock() - start;
+        }
+    }
+
+    // Writes what is left and closes the file. Returns false if the file could not be written.
+    bool close()
+    {
+        flush();
+        if (discard)
+        {
+            return true;
+        }
+        if (stream != nullptr)
+        {
+            return bool(stream->flush());
+        }
+        if (!file.is_open())
+        {
+            return false;
+        }
+
+        file.close(); // Close the file when done
+        return true;
+    }
+};
+
+// Distribution of a timing over the replicas
+struct distribution
+{
+    int min;
+    double mean;
+    int p50;
+    int p99;
+    int max;
+};
+
+// Summarizes samples (sorted in place); percentiles use the nearest rank
+distribution summarize(std::vector<int> &samples)
+{
+    std::sort(samples.begin(), samples.end());
+    double sum = 0;
+    for (int sample : samples)
+    {
+        sum += sample;
+    }
+
+    auto rank = [&](int percent)
+    {
+        std::size_t index = (samples.size() * percent + 99) / 100;
+        return samples[index > 0 ? index - 1 : 0];
+    };
+    return {samples.front(), sum / samples.size(), rank(50), rank(99), samples.back()};
+}
+
+void output_sink::put(const hex_address &address)
+{
+    char digits[8];
+    for (int byte = 0; byte < 4; byte++)
+    {
+        std::memcpy(digits + 2 * byte, HEX_PAIRS.pairs + 2 * ((address.value >> (24 - 8 * byte)) & 0xFF), 2);
+    }
+
+    int first = 0;
+    while (first < 4 && digits[first] == '0')
+    {
+        first++;
+    }
+    buffer.append(address.prefix);
+    buffer.append(digits + first, 8 - first);
+}
+
+// Helper function for a sanity check. Prints the external files table
+void print_external_files(const std::vector<external_file> &files)
+{
+    const int tableWidth = 24;
+
+    std::cout << "List of external files (" << files.size() << " entry(s)): " << std::endl;
+
+    // Print top border
+    std::cout << "+" << std::setfill('-') << std::setw(tableWidth) << "+" << std::endl;
+
+    // Print headers
+    std::cout << "|"
+              << std::setfill(' ') << std::setw(10) << "file name"
+              << std::setw(2) << "|"
+              << std::setfill(' ') << std::setw(10) << "files size"
+              << std::setw(2) << "|" << std::endl;
+
+    // Print separator
+    std::cout << "+" << std::setfill('-') << std::setw(tableWidth) << "+" << std::endl;
+
+    // Print each PCB entry
+    for (const auto &file : files)
+    {
+        std::cout << "|"
+                  << std::setfill(' ') << std::setw(10) << file.program_name
+                  << std::setw(2) << "|"
+                  << std::setw(10) << file.size
+                  << std::setw(2) << "|" << std::endl;
+    }
+
+    // Print bottom border
+    std::cout << "+" << std::setfill('-') << std::setw(tableWidth) << "+" << std::endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Event log: the simulation records typed events (one per execution log line, plus the system
+// status snapshots) into a columnar buffer. execution.txt and system_status.txt are rendered from
+// the events, only if asked for, and the events can be written to a binary file as they are.
+// (event_kind is defined with the interrupt handler tables, whose steps are events.)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define EVENT_CHUNK_SIZE (64 * 1024) //!< events buffered before they are rendered/written (if they are)
+#define EVENTS_MAGIC "INTREVT"        //!< first 8 bytes of a binary event file (with the '\0')
+#define NO_NAME 0xFFFFFFFFu           //!< name of a program not interned by the event_log yet
+#define EVENTS_VERSION 5
+
+struct snapshot_writer;
+
+// The events of a simulation, one column per field (event k is time[k], duration[k], ...).
+// The consumers are optional: every EVENT_CHUNK_SIZE events (and at the end) the buffered events
+// are rendered into the attached text sinks, written to the binary file and to the snapshot
+// store, then dropped. With no consumer attached, all the events stay in memory for the caller.
+struct event_log
+{
+    std::vector<int32_t> time;
+    std::vector<int32_t> duration;
+    std::vector<event_kind> kind;
+    std::vector<uint16_t> core;
+    std::vector<uint32_t> pid;
+    std::vector<int32_t> number;
+    std::vector<int32_t> partition;
+    std::vector<uint32_t> name; // index into names
+
+    std::vector<std::string> names; // program names, interned
+    std::unordered_map<std::string, uint32_t> name_ids;
+    std::vector<uint32_t> program_names; // interned name of each registry program id (NO_NAME: not yet)
+    std::size_t names_written = 0; // names already in the binary file
+
+    bool recording = true; // false: every event is dropped (replicas that only keep their timings)
+
+    const std::vector<unsigned int> *vectors = nullptr; // vector table, for the ISR addresses
+    output_sink *execution = nullptr;
+    output_sink *system_status = nullptr;
+    std::ofstream *binary = nullptr;
+    snapshot_writer *snapshots = nullptr;
+    run_stats *stats = nullptr; // if set (and timing), drain() adds its formatting and writing time
+
+    std::size_t size() const { return time.size(); }
+
+    uint32_t intern(const std::string &program_name)
+    {
+        auto found = name_ids.find(program_name);
+        if (found != name_ids.end())
+        {
+            return found->second;
+        }
+        names.push_back(program_name);
+        name_ids.emplace(program_name, names.size() - 1);
+        return names.size() - 1;
+    }
+
+    void add(int event_time, int event_duration, event_kind event, unsigned int event_pid,
+             int event_number = 0, int event_partition = -1, uint32_t event_name = 0, unsigned int event_core = 0)
+    {
+        if (!recording)
+        {
+            return;
+        }
+
+        // a snapshot's rows are never split from it
+        if (size() >= EVENT_CHUNK_SIZE && event < event_kind::ROW_RUNNING)
+        {
+            drain();
+        }
+
+        time.push_back(event_time);
+        duration.push_back(event_duration);
+        kind.push_back(event);
+        core.push_back(event_core);
+        pid.push_back(event_pid);
+        number.push_back(event_number);
+        partition.push_back(event_partition);
+        name.push_back(event_name);
+    }
+
+    // Interns the name of a registered program (looked up once per program id)
+    uint32_t intern(const program_registry &programs, unsigned int program)
+    {
+        if (program >= program_names.size())
+        {
+            program_names.resize(programs.images.size(), NO_NAME);
+        }
+        if (program_names[program] == NO_NAME)
+        {
+            program_names[program] = intern(programs.images[program].name);
+        }
+        return program_names[program];
+    }
+
+    // Records a row of a system status snapshot
+    void add_row(event_kind state, int event_time, const PCB &process, const program_registry &programs)
+    {
+        if (recording)
+        {
+            add(event_time, 0, state, process.PID, process.size, process.partition_number, intern(programs, process.program));
+        }
+    }
+
+    // Records a process taking or giving back its partition (PARTITION_TAKEN, PARTITION_FREED)
+    void add_partition(event_kind change, int event_time, const PCB &process)
+    {
+        add(event_time, 0, change, process.PID, 0, process.partition_number);
+    }
+
+    void clear()
+    {
+        time.clear();
+        duration.clear();
+        kind.clear();
+        core.clear();
+        pid.clear();
+        number.clear();
+        partition.clear();
+        name.clear();
+    }
+
+    // Hands the buffered events to the consumers (if any) and drops them
+    void drain();
+};
+
+// Renders events into the execution log (the partition changes and the snapshots are skipped)
+void render_execution(const event_log &events, output_sink &execution)
+{
+    static const char *const messages[] = {
+        "CPU Burst", "Switch to kernel mode", "switch to kernel mode", "context saved", "", "", "",
+        "obtain ISR address", "Call device driver", "Perform device check", "Send device instruction",
+        "store information in memory", "reset the io operation", "Send standby instruction", "IRET",
+        "cloning the PCB", "FORK failed: No memory for child process", "scheduler called", "", "",
+        "loading program into memory", "marking partition as occupied", "updating PCB", "", "", "setting up the page table",
+        "CPU Burst", "", "", "", "FORK waiting for memory", "FORK failed: No memory for child process", "", "", "",
+        "terminated", "preempted", "", "", "", ""};
+    static_assert(sizeof(messages) / sizeof(messages[0]) == static_cast<int>(event_kind::CORE_DISPATCHED) + 1, "one message per execution event");
+    static const std::string no_name;
+
+    const std::vector<unsigned int> &vectors = *events.vectors;
+    for (std::size_t k = 0; k < events.size(); k++)
+    {
+        const event_kind kind = events.kind[k];
+        const int time = events.time[k], duration = events.duration[k], number = events.number[k];
+        const std::string &name = events.names.empty() ? no_name : events.names[events.name[k]];
+
+        if (kind > event_kind::CORE_DISPATCHED)
+        {
+            continue;
+        }
+        if (kind >= event_kind::CORE_CPU_BURST)
+        {
+            if (kind == event_kind::CORE_DISPATCHED)
+            {
+                execution.log(time, duration, "core ", events.core[k], ": scheduler dispatched PID ", events.pid[k]);
+                continue;
+            }
+            if (kind == event_kind::CORE_IO_DONE)
+            {
+                execution.log(time, duration, "device ", number, ": completion interrupt, PID ", events.pid[k], " ready");
+                continue;
+            }
+            execution.print(time, ", ", duration, ", core ", events.core[k], ": PID ", events.pid[k], ' ');
+        }
+
+        switch (kind)
+        {
+        case event_kind::FIND_VECTOR:
+            execution.log(time, duration, "find vector ", number, " in memory ", hex_address{vectors.at(number)});
+            break;
+        case event_kind::FIND_VECTOR_POSITION:
+            execution.log(time, duration, "find vector ", number, " in memory position ",
+                          hex_address{static_cast<unsigned int>(ADDR_BASE + (number * VECTOR_SIZE)), "0x"});
+            break;
+        case event_kind::LOAD_ADDRESS:
+            execution.log(time, duration, "load address ", hex_address{vectors.at(number)}, " into the PC");
+            break;
+        case event_kind::PROGRAM_SIZE:
+            execution.log(time, duration, "Program is ", number, " Mb large");
+            break;
+        case event_kind::EXEC_FAILED:
+            execution.log(time, duration, "EXEC failed: Memory allocation failed for ", name);
+            break;
+        case event_kind::ISR_STEP:
+            execution.log(time, duration, name);
+            break;
+        case event_kind::PAGE_FAULT:
+            execution.log(time, duration, "page fault: loading page ", number, " into memory");
+            break;
+        case event_kind::CORE_SYSCALL:
+            execution.print("SYSCALL, device ", number, '\n');
+            break;
+        case event_kind::CORE_END_IO:
+            execution.print("END_IO, device ", number, '\n');
+            break;
+        case event_kind::CORE_INTERRUPT:
+            execution.print(name, ", ", number, '\n');
+            break;
+        case event_kind::CORE_IO_STARTED:
+            execution.print("SYSCALL, device ", number, " started, blocked until it completes\n");
+            break;
+        case event_kind::CORE_FORK:
+            execution.print("FORK, child PID ", number, '\n');
+            break;
+        case event_kind::CORE_EXEC:
+            execution.print("EXEC ", name, ", partition ", events.partition[k], '\n');
+            break;
+        case event_kind::CORE_EXEC_WAITING:
+            execution.print("EXEC ", name, " waiting for memory\n");
+            break;
+        case event_kind::CORE_EXEC_FAILED:
+            execution.print("EXEC failed: Memory allocation failed for ", name, '\n');
+            break;
+        default:
+            if (kind >= event_kind::CORE_CPU_BURST)
+                execution.print(messages[static_cast<int>(kind)], '\n');
+            else
+                execution.log(time, duration, messages[static_cast<int>(kind)]);
+        }
+    }
+}
+
+// Renders the snapshots of the events into the system status log: after each FORK/EXEC, the
+// trace line and a PCB table with one row per process and its state
+void render_status(const event_log &events, output_sink &system_status)
+{
+    static const char border[] = "+------------------------------------------------------+\n";
+
+    for (std::size_t k = 0; k < events.size(); k++)
+    {
+        const event_kind kind = events.kind[k];
+        if (kind < event_kind::STATUS_FORK)
+        {
+            continue;
+        }
+
+        if (kind == event_kind::STATUS_FORK || kind == event_kind::STATUS_EXEC)
+        {
+            system_status.print("time: ", events.time[k], "; current trace: ");
+            if (kind == event_kind::STATUS_FORK)
+                system_status.print("FORK, ", events.number[k], '\n');
+            else
+                system_status.print("EXEC ", events.names[events.name[k]], ", ", events.number[k], '\n');
+            system_status.print(border, "| PID |program name |partition number | size |   state |\n", border);
+            continue;
+        }
+
+        static const char *const states[] = {"running", "ready", "waiting"};
+        system_status.put('|');
+        system_status.put_padded(events.pid[k], 4);
+        system_status.put(" |");
+        system_status.put_padded(std::string_view(events.names[events.name[k]]), 12);
+        system_status.put(" |");
+        system_status.put_padded(events.partition[k], 16);
+        system_status.put(" |");
+        system_status.put_padded(static_cast<unsigned int>(events.number[k]), 5);
+        system_status.put(" |");
+        system_status.put_padded(std::string_view(states[static_cast<int>(kind) - static_cast<int>(event_kind::ROW_RUNNING)]), 8);
+        system_status.put(" |\n");
+
+        // the last row of a snapshot closes its table
+        if (k + 1 == events.size() || events.kind[k + 1] < event_kind::ROW_RUNNING)
+        {
+            system_status.print(border, '\n');
+        }
+    }
+}
+
+// Binary event file: a header with the vector table, then one block per chunk of events:
+//   uint64_t event_count, uint64_t name_count (names first used in this chunk)
+//   the columns, in event_log order (time, duration, kind, core, pid, number, partition, name)
+//   name_count x { uint64_t length, characters }
+// Every section starts on an 8-byte boundary (see write_section).
+struct events_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // SCENARIO_BYTE_ORDER as written
+    uint64_t vector_count;
+};
+
+// Writes the header of a binary event file
+void begin_event_file(std::ofstream &output_file, const std::vector<unsigned int> &vectors)
+{
+    events_header header = {EVENTS_MAGIC, EVENTS_VERSION, SCENARIO_BYTE_ORDER, vectors.size()};
+    write_section(output_file, &header, sizeof(header));
+    std::vector<uint32_t> table(vectors.begin(), vectors.end());
+    write_section(output_file, table.data(), table.size() * sizeof(uint32_t));
+}
+
+// Appends the buffered events (and the names they introduced) to a binary event file
+void write_events(event_log &events, std::ofstream &output_file)
+{
+    uint64_t counts[2] = {events.size(), events.names.size() - events.names_written};
+    write_section(output_file, counts, sizeof(counts));
+
+    write_section(output_file, events.time.data(), events.size() * sizeof(int32_t));
+    write_section(output_file, events.duration.data(), events.size() * sizeof(int32_t));
+    write_section(output_file, events.kind.data(), events.size() * sizeof(event_kind));
+    write_section(output_file, events.core.data(), events.size() * sizeof(uint16_t));
+    write_section(output_file, events.pid.data(), events.size() * sizeof(uint32_t));
+    write_section(output_file, events.number.data(), events.size() * sizeof(int32_t));
+    write_section(output_file, events.partition.data(), events.size() * sizeof(int32_t));
+    write_section(output_file, events.name.data(), events.size() * sizeof(uint32_t));
+
+    for (; events.names_written < events.names.size(); events.names_written++)
+    {
+        const std::string &program_name = events.names[events.names_written];
+        uint64_t length = program_name.size();
+        write_section(output_file, &length, sizeof(length));
+        write_section(output_file, program_name.data(), program_name.size());
+    }
+}
+
+void add_snapshots(snapshot_writer &writer, const event_log &events); // see the snapshot store
+
+void event_log::drain()
+{
+    if (execution == nullptr && system_status == nullptr && binary == nullptr && snapshots == nullptr)
+    {
+        return; // the events stay in memory
+    }
+
+    const bool timed = stats != nullptr && stats->host_timing;
+    double start = timed ? host_clock() : 0;
+    const double written = timed ? stats->write_seconds : 0; // the sinks add their own writes
+
+    if (execution != nullptr)
+    {
+        render_execution(*this, *execution);
+    }
+    if (system_status != nullptr)
+    {
+        render_status(*this, *system_status);
+    }
+    if (timed)
+    {
+        const double now = host_clock();
+        stats->format_seconds += now - start - (stats->write_seconds - written);
+        start = now;
+    }
+
+    if (binary != nullptr)
+    {
+        write_events(*this, *binary);
+    }
+    if (snapshots != nullptr)
+    {
+        add_snapshots(*snapshots, *this);
+    }
+    if (timed)
+    {
+        stats->write_seconds += host_clock() - start;
+    }
+    clear();
+}
+
+// Reads a binary event file chunk by chunk, rendering the text logs into the given sinks.
+// Throws std::runtime_error if the file cannot be mapped or is not an event file.
+void render_event_file(const std::string &filename, output_sink &execution, output_sink &system_status)
+{
+    mapped_file file(filename);
+    scenario_reader reader = {file.data, file.data + file.size};
+
+    const events_header header = *reader.section<events_header>(1);
+    if (std::memcmp(header.magic, EVENTS_MAGIC, sizeof(header.magic)) != 0)
+    {
+        throw std::runtime_error("Not an event file: " + filename);
+    }
+    if (header.version != EVENTS_VERSION || header.byte_order != SCENARIO_BYTE_ORDER)
+    {
+        throw std::runtime_error("Unsupported event file version or layout: " + filename);
+    }
+
+    const uint32_t *table = reader.section<uint32_t>(header.vector_count);
+    std::vector<unsigned int> vectors(table, table + header.vector_count);
+
+    event_log events;
+    events.vectors = &vectors;
+    while (reader.position < reader.end)
+    {
+        const uint64_t *counts = reader.section<uint64_t>(2);
+        const uint64_t count = counts[0], name_count = counts[1];
+
+        auto column = [&](auto &values)
+        {
+            using value_type = typename std::remove_reference<decltype(values)>::type::value_type;
+            const value_type *data = reader.section<value_type>(count);
+            values.assign(data, data + count);
+        };
+        column(events.time);
+        column(events.duration);
+        column(events.kind);
+        column(events.core);
+        column(events.pid);
+        column(events.number);
+        column(events.partition);
+        column(events.name);
+
+        for (uint64_t k = 0; k < name_count; k++)
+        {
+            uint64_t length = *reader.section<uint64_t>(1);
+            const char *characters = reader.section<char>(length);
+            events.names.emplace_back(characters, length);
+        }
+
+        for (std::size_t k = 0; k < events.size(); k++)
+        {
+            const event_kind kind = events.kind[k];
+            const bool named = kind == event_kind::EXEC_FAILED || kind == event_kind::ISR_STEP || kind == event_kind::STATUS_EXEC ||
+                               kind >= event_kind::ROW_RUNNING || kind == event_kind::CORE_INTERRUPT ||
+                               (kind >= event_kind::CORE_EXEC && kind <= event_kind::CORE_EXEC_FAILED);
+            if (kind > event_kind::ROW_WAITING || (named && events.name[k] >= events.names.size()))
+            {
+                throw std::runtime_error("Corrupt event file: " + filename);
+            }
+        }
+
+        render_execution(events, execution);
+        render_status(events, system_status);
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// Snapshot store (--snapshots, --query): the system status snapshots of a run indexed by time, and
+// the intervals during which each partition was occupied. Every SNAPSHOT_KEYFRAME_INTERVAL-th
+// snapshot is stored whole (a keyframe), the others as a delta from the snapshot before them: the
+// number of its rows they keep, then their own. The index is written last, when the run is over:
+// the state at a time is found with a binary search over the keyframes and at most
+// SNAPSHOT_KEYFRAME_INTERVAL - 1 deltas, the intervals of a partition with a binary search.
+//
+// Layout (host byte order, every section starts on an 8-byte boundary):
+//   snapshots_header
+//   snapshots        snapshot_count x { packed_snapshot, packed_row[added] }
+//   index            snapshots_index
+//                    partition sizes   uint32_t[partition_count]
+//                    names             name_count x { uint64_t length, characters }
+//                    keyframes         snapshot_keyframe[keyframe_count]
+//                    first interval    uint64_t[partition_count + 1], of each partition
+//                    intervals         partition_interval[interval_count], by partition then by time
+//   uint64_t         offset of the index
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define SNAPSHOTS_MAGIC "INTRSNP"     //!< first 8 bytes of a snapshot store (with the '\0')
+#define SNAPSHOTS_VERSION 2
+#define SNAPSHOT_KEYFRAME_INTERVAL 64 //!< snapshots from one keyframe to the next
+
+struct snapshots_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // SCENARIO_BYTE_ORDER as written
+};
+
+// A snapshot: the trace line it follows (as in the system status log) and how it was stored
+struct packed_snapshot
+{
+    int32_t time;
+    uint32_t pid;     // of the process that ran the line
+    int32_t operand;
+    uint32_t name;    // program (STATUS_EXEC)
+    uint32_t kept;    // rows of the snapshot before that it starts with (0 for a keyframe)
+    uint32_t added;   // rows stored after it
+    event_kind kind;  // STATUS_FORK or STATUS_EXEC
+    uint8_t padding[3];
+};
+
+// A row of a snapshot. The rows shared with the snapshot before come first: the ready and
+// waiting processes, in the order of the log, then the running ones.
+struct packed_row
+{
+    uint32_t pid;
+    uint32_t name; // program
+    int32_t partition;
+    uint32_t size;
+    event_kind state; // ROW_RUNNING, ROW_READY or ROW_WAITING
+    uint8_t padding[3];
+};
+
+struct snapshots_index
+{
+    uint64_t snapshot_count;
+    uint64_t name_count;
+    uint64_t keyframe_count;
+    uint64_t partition_count;
+    uint64_t interval_count;
+    int32_t end_time; // of the run
+    uint32_t padding;
+};
+
+struct snapshot_keyframe
+{
+    int32_t time;
+    uint32_t padding;
+    uint64_t snapshot; // its index
+    uint64_t offset;   // of its packed_snapshot in the file
+};
+
+// A partition held by a process from 'start' to 'end' (the end of the run if it kept it)
+struct partition_interval
+{
+    int32_t start;
+    int32_t end;
+    uint32_t pid;
+    uint32_t padding;
+};
+
+// Builds a snapshot store from the events, chunk by chunk (see add_snapshots)
+struct snapshot_writer
+{
+    std::ofstream file;
+    uint64_t offset = 0;                                    // bytes written so far
+    uint64_t count = 0;                                     // snapshots written so far
+    std::vector<packed_row> rows, next;                     // of the last snapshot and of the one being stored
+    std::vector<snapshot_keyframe> keyframes;
+    std::vector<partition_interval> holders;                // current holder of each partition (start -1: free)
+    std::vector<std::vector<partition_interval>> intervals; // closed intervals of each partition, in time order
+};
+
+// Appends a section to a snapshot store, keeping its offset
+void put_section(snapshot_writer &writer, const void *data, std::size_t bytes)
+{
+    write_section(writer.file, data, bytes);
+    writer.offset += bytes + (8 - bytes % 8) % 8;
+}
+
+// Opens a snapshot store for a partition table of 'partitions' partitions and writes its header
+void begin_snapshots(snapshot_writer &writer, const std::string &filename, std::size_t partitions)
+{
+    writer.file.open(filename, std::ios::binary);
+    snapshots_header header = {SNAPSHOTS_MAGIC, SNAPSHOTS_VERSION, SCENARIO_BYTE_ORDER};
+    put_section(writer, &header, sizeof(header));
+    writer.holders.assign(partitions, {-1, -1, 0, 0});
+    writer.intervals.assign(partitions, {});
+}
+
+// Stores the snapshots of the buffered events and follows their partition changes
+void add_snapshots(snapshot_writer &writer, const event_log &events)
+{
+    for (std::size_t k = 0; k < events.size(); k++)
+    {
+        const event_kind kind = events.kind[k];
+        if (kind == event_kind::PARTITION_TAKEN || kind == event_kind::PARTITION_FREED)
+        {
+            const std::size_t index = events.partition[k] - 1;
+            partition_interval &holder = writer.holders[index];
+            if (kind == event_kind::PARTITION_TAKEN)
+            {
+                holder = {events.time[k], -1, events.pid[k], 0};
+            }
+            else if (holder.start != -1)
+            {
+                holder.end = events.time[k];
+                writer.intervals[index].push_back(holder);
+                holder.start = -1;
+            }
+            continue;
+        }
+        if (kind != event_kind::STATUS_FORK && kind != event_kind::STATUS_EXEC)
+        {
+            continue;
+        }
+
+        // the rows follow their snapshot (a chunk never splits them): the running ones go last
+        std::size_t end = k + 1;
+        while (end < events.size() && events.kind[end] >= event_kind::ROW_RUNNING)
+        {
+            end++;
+        }
+        writer.next.clear();
+        for (bool running : {false, true})
+        {
+            for (std::size_t row = k + 1; row < end; row++)
+            {
+                if ((events.kind[row] == event_kind::ROW_RUNNING) == running)
+                {
+                    writer.next.push_back({events.pid[row], events.name[row], events.partition[row],
+                                           static_cast<uint32_t>(events.number[row]), events.kind[row], {}});
+                }
+            }
+        }
+
+        uint32_t kept = 0;
+        if (writer.count % SNAPSHOT_KEYFRAME_INTERVAL == 0)
+        {
+            writer.keyframes.push_back({events.time[k], 0, writer.count, writer.offset});
+        }
+        else
+        {
+            while (kept < writer.rows.size() && kept < writer.next.size() &&
+                   std::memcmp(&writer.rows[kept], &writer.next[kept], sizeof(packed_row)) == 0)
+            {
+                kept++;
+            }
+        }
+
+        const uint32_t added = writer.next.size() - kept;
+        packed_snapshot snapshot = {events.time[k], events.pid[k], events.number[k], events.name[k], kept, added, kind, {}};
+        put_section(writer, &snapshot, sizeof(snapshot));
+        put_section(writer, writer.next.data() + kept, added * sizeof(packed_row));
+        writer.rows.swap(writer.next);
+        writer.count++;
+        k = end - 1;
+    }
+}
+
+// Closes the intervals of the partitions still held at the end of the run and writes the index.
+// Returns false if the file could not be written.
+bool end_snapshots(snapshot_writer &writer, const std::vector<std::string> &names, const std::vector<unsigned int> &sizes, int end_time)
+{
+    const uint64_t index_offset = writer.offset;
+
+    std::vector<uint64_t> first_interval = {0};
+    for (std::size_t partition = 0; partition < writer.holders.size(); partition++)
+    {
+        partition_interval &holder = writer.holders[partition];
+        if (holder.start != -1)
+        {
+            holder.end = end_time;
+            writer.intervals[partition].push_back(holder);
+        }
+        first_interval.push_back(first_interval.back() + writer.intervals[partition].size());
+    }
+
+    snapshots_index index = {writer.count, names.size(), writer.keyframes.size(), sizes.size(), first_interval.back(), end_time, 0};
+    put_section(writer, &index, sizeof(index));
+    std::vector<uint32_t> table(sizes.begin(), sizes.end());
+    put_section(writer, table.data(), table.size() * sizeof(uint32_t));
+    for (const auto &program_name : names)
+    {
+        uint64_t length = program_name.size();
+        put_section(writer, &length, sizeof(length));
+        put_section(writer, program_name.data(), program_name.size());
+    }
+    put_section(writer, writer.keyframes.data(), writer.keyframes.size() * sizeof(snapshot_keyframe));
+    put_section(writer, first_interval.data(), first_interval.size() * sizeof(uint64_t));
+    for (const auto &partition : writer.intervals)
+    {
+        put_section(writer, partition.data(), partition.size() * sizeof(partition_interval));
+    }
+    put_section(writer, &index_offset, sizeof(index_offset));
+
+    writer.file.close();
+    return !writer.file.fail();
+}
+
+// A snapshot read back from a store, with its rows in the order of the system status log
+struct stored_snapshot
+{
+    packed_snapshot record;
+    std::vector<packed_row> rows;
+};
+
+// A snapshot store mapped for queries. Throws std::runtime_error if the file cannot be mapped or
+// is not a snapshot store.
+struct snapshot_store
+{
+    mapped_file file;
+    const char *index_begin; // end of the snapshots
+    snapshots_index index;
+    std::vector<unsigned int> sizes; // of the partitions
+    std::vector<std::string> names;
+    const snapshot_keyframe *keyframes;
+    const uint64_t *first_interval;
+    const partition_interval *intervals;
+
+    snapshot_store(const std::string &filename) : file(filename)
+    {
+        scenario_reader reader = {file.data, file.data + file.size};
+        const snapshots_header header = *reader.section<snapshots_header>(1);
+        if (std::memcmp(header.magic, SNAPSHOTS_MAGIC, sizeof(header.magic)) != 0)
+        {
+            throw std::runtime_error("Not a snapshot store: " + filename);
+        }
+        if (header.version != SNAPSHOTS_VERSION || header.byte_order != SCENARIO_BYTE_ORDER)
+        {
+            throw std::runtime_error("Unsupported snapshot store version or layout: " + filename);
+        }
+
+        uint64_t index_offset = 0;
+        if (file.size >= sizeof(header) + sizeof(index_offset))
+        {
+            std::memcpy(&index_offset, file.data + file.size - sizeof(index_offset), sizeof(index_offset));
+        }
+        if (index_offset < sizeof(header) || index_offset > file.size - sizeof(index_offset))
+        {
+            throw std::runtime_error("Corrupt snapshot store: " + filename);
+        }
+        index_begin = file.data + index_offset;
+
+        scenario_reader tail = {index_begin, file.data + file.size - sizeof(index_offset)};
+        index = *tail.section<snapshots_index>(1);
+        const uint32_t *table = tail.section<uint32_t>(index.partition_count);
+        sizes.assign(table, table + index.partition_count);
+        for (uint64_t k = 0; k < index.name_count; k++)
+        {
+            uint64_t length = *tail.section<uint64_t>(1);
+            const char *characters = tail.section<char>(length);
+            names.emplace_back(characters, length);
+        }
+        keyframes = tail.section<snapshot_keyframe>(index.keyframe_count);
+        first_interval = tail.section<uint64_t>(index.partition_count + 1);
+        intervals = tail.section<partition_interval>(index.interval_count);
+
+        for (uint64_t k = 0; k < index.keyframe_count; k++)
+        {
+            if (keyframes[k].offset >= index_offset || keyframes[k].snapshot >= index.snapshot_count)
+            {
+                throw std::runtime_error("Corrupt snapshot store: " + filename);
+            }
+        }
+        for (uint64_t partition = 0; partition < index.partition_count; partition++)
+        {
+            if (first_interval[partition] > first_interval[partition + 1])
+            {
+                throw std::runtime_error("Corrupt snapshot store: " + filename);
+            }
+        }
+        if (first_interval[0] != 0 || first_interval[index.partition_count] != index.interval_count)
+        {
+            throw std::runtime_error("Corrupt snapshot store: " + filename);
+        }
+    }
+
+    /**
+     * \brief the last snapshot taken at or before a time
+     *
+     * Starts from the last keyframe at or before 'time' and applies the deltas after it.
+     *
+     * @param time the time
+     * @param state receives the snapshot
+     * @return false if no snapshot was taken at or before 'time'
+     *
+     */
+    bool state_at(int time, stored_snapshot &state) const
+    {
+        const snapshot_keyframe *keyframe = std::upper_bound(keyframes, keyframes + index.keyframe_count, time,
+                                                             [](int t, const snapshot_keyframe &key) { return t < key.time; });
+        if (keyframe == keyframes)
+        {
+            return false;
+        }
+        keyframe--;
+
+        scenario_reader reader = {file.data + keyframe->offset, index_begin};
+        std::vector<packed_row> rows; // as stored
+        for (uint64_t k = keyframe->snapshot; k < index.snapshot_count && reader.position < reader.end; k++)
+        {
+            const packed_snapshot record = *reader.section<packed_snapshot>(1);
+            if (k > keyframe->snapshot && record.time > time)
+            {
+                break;
+            }
+            if (record.kept > rows.size() || (record.kind != event_kind::STATUS_FORK && record.kind != event_kind::STATUS_EXEC) ||
+                (record.kind == event_kind::STATUS_EXEC && record.name >= names.size()))
+            {
+                throw std::runtime_error("Corrupt snapshot store");
+            }
+            const packed_row *added = reader.section<packed_row>(record.added);
+            rows.resize(record.kept);
+            rows.insert(rows.end(), added, added + record.added);
+            state.record = record;
+        }
+
+        state.rows.clear();
+        for (bool running : {true, false})
+        {
+            for (const auto &row : rows)
+            {
+                if (row.name >= names.size() || row.state < event_kind::ROW_RUNNING || row.state > event_kind::ROW_WAITING)
+                {
+                    throw std::runtime_error("Corrupt snapshot store");
+                }
+                if ((row.state == event_kind::ROW_RUNNING) == running)
+                {
+                    state.rows.push_back(row);
+                }
+            }
+        }
+        return true;
+    }
+
+    // The intervals during which partition 'number' (from 1) was held that overlap [from, to]
+    std::pair<const partition_interval *, const partition_interval *> occupied(unsigned int number, int from, int to) const
+    {
+        const partition_interval *begin = intervals + first_interval[number - 1];
+        const partition_interval *end = intervals + first_interval[number];
+
+        // the intervals of a partition do not overlap: their starts and their ends are both in order
+        begin = std::partition_point(begin, end, [&](const partition_interval &interval) { return interval.end <= from; });
+        end = std::partition_point(begin, end, [&](const partition_interval &interval) { return interval.start <= to; });
+        return {begin, end};
+    }
+
+    // The interval during which partition 'number' (from 1) was held at 'time' (nullptr: it was free)
+    const partition_interval *holder(unsigned int number, int time) const
+    {
+        auto [begin, end] = occupied(number, time, time);
+        return begin != end ? begin : nullptr;
+    }
+};
+
+// What the steps of a handler are run for
+struct isr_call
+{
+    unsigned int pid;
+    int operand;                   // of the trace line
+    unsigned int size;             // program size (EXEC)
+    uint32_t name;                 // interned program name (EXEC_FAILED)
+    int frame_time;                // time the running frame started
+    bool fixed_frame_time = false; // the running frame's fixed_start
+};
+
+/**
+ * \brief record the steps of an interrupt handler
+ *
+ * Each step is recorded as an event of call.pid, and takes its time (see step_cost). The device
+ * delay is split from delays[call.operand] with the simulator's random number generator; a
+ * speculative simulator records the split as a delay_span instead, to be drawn when it is merged.
+ *
+ * @param steps the steps, in order
+ * @param call the trace line handled
+ * @param time time at which the handler starts
+ * @param snapshot called as snapshot(time) for the SNAPSHOT steps
+ * @return the time after the steps
+ *
+ */
+template <typename Snapshot>
+int run_isr_steps(const std::vector<isr_step> &steps, const isr_call &call, int time, simulator &sim, event_log &events, const Snapshot &snapshot)
+{
+    int remaining = -1; // what is left of the device delay (-1: not taken yet)
+
+    for (const auto &step : steps)
+    {
+        int duration = step.value;
+        switch (step.cost)
+        {
+        case step_cost::FIXED:
+            break;
+        case step_cost::OPERAND:
+            duration = call.operand;
+            break;
+        case step_cost::PER_MB:
+            duration = step.value * call.size;
+            break;
+        case step_cost::DELAY_RANDOM:
+        case step_cost::DELAY_REST:
+            if (remaining == -1)
+            {
+                remaining = sim.delays[call.operand];
+                if (sim.speculative)
+                {
+                    sim.spans.push_back({events.size(), &step, 0, remaining, time});
+                }
+            }
+            if (sim.speculative && step.cost == step_cost::DELAY_REST)
+            {
+                sim.spans.back().count = &step - sim.spans.back().steps + 1;
+            }
+            // (a speculative branch draws 0: the steps still add up to the device delay)
+            duration = step.cost == step_cost::DELAY_REST ? remaining : static_cast<int>(sim.speculative ? 0 : sim.rng() % remaining) - step.value;
+            remaining = step.cost == step_cost::DELAY_REST ? -1 : remaining - duration;
+            break;
+        case step_cost::SNAPSHOT:
+            snapshot(time);
+            continue;
+        }
+
+        const int number = step.number == NUMBER_OPERAND ? call.operand : step.number == NUMBER_SIZE ? static_cast<int>(call.size) : step.number;
+        uint32_t name = call.name;
+        if (step.event == event_kind::ISR_STEP && events.recording)
+        {
+            name = events.intern(sim.context.isr.messages[step.message]);
+        }
+        if (step.frame_time && call.fixed_frame_time && events.recording)
+        {
+            sim.fixed_events.push_back(events.size());
+        }
+        events.add(step.frame_time ? call.frame_time : time, duration, step.event, call.pid, number, -1, name);
+        time += step.advance == LOGGED_TIME ? duration : step.advance;
+    }
+    return time;
+}
+
+// A process waiting for its child, below the frames of a speculative branch (--parallel-forks).
+// A branch only copies its parent's frame: the processes below it are immutable while it runs,
+// so it holds the node of the nearest one, and the nodes are shared by the branches above them.
+struct waiting_process
+{
+    PCB pcb;
+    std::shared_ptr<const waiting_process> below;
+};
+
+// Records the system status snapshot of the sequential simulation: the top frame's process is
+// running, the ones below it wait for their child (in a branch, the 'below' ones first)
+void record_PCB(event_log &events, int time, const instruction &instr, const std::vector<PCB> &processes, const std::vector<frame> &frames,
+                const program_registry &programs, const waiting_process *below = nullptr)
+{
+    if (!events.recording)
+    {
+        return;
+    }
+
+    const PCB &running = processes[frames.back().process];
+    if (instr.op == opcode::EXEC)
+        events.add(time, 0, event_kind::STATUS_EXEC, running.PID, instr.operand, -1, events.intern(programs, instr.program));
+    else
+        events.add(time, 0, event_kind::STATUS_FORK, running.PID, instr.operand);
+
+    events.add_row(event_kind::ROW_RUNNING, time, running, programs);
+    if (below != nullptr)
+    {
+        std::vector<const PCB *> rows; // (the nodes link downwards, the rows go upwards)
+        for (; below != nullptr; below = below->below.get())
+        {
+            rows.push_back(&below->pcb);
+        }
+        for (auto row = rows.rbegin(); row != rows.rend(); row++)
+        {
+            events.add_row(event_kind::ROW_WAITING, time, **row, programs);
+        }
+    }
+    for (std::size_t k = 0; k + 1 < frames.size(); k++)
+    {
+        events.add_row(event_kind::ROW_WAITING, time, processes[frames[k].process], programs);
+    }
 }
 
 #endif
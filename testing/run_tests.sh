@@ -0,0 +1,72 @@
+#!/bin/bash
+# Runs every test of this directory and compares what it writes with its expected outputs.
+# Build first (./build.sh), then: ./testing/run_tests.sh [test name]...
+#
+# A test is <name>/input_files, where bin/interrupts runs, and <name>/output_files, the files it
+# must write there. input_files/runs.txt, if present, holds the arguments of each run, one run per
+# line (default: trace.txt vector_table.txt device_table.txt external_files.txt); the files are
+# compared after the last run, whose standard output is kept in stdout.txt. Everything the runs
+# write is deleted afterwards.
+
+cd "$(dirname "$0")"
+interrupts=../../../bin/interrupts
+if [ ! -x ../bin/interrupts ]; then
+    echo "bin/interrupts not found, run ./build.sh first"
+    exit 1
+fi
+
+tests=("$@")
+if [ ${#tests[@]} -eq 0 ]; then
+    tests=($(ls -d */ | tr -d / | sort -V))
+fi
+
+failed=0
+for test in "${tests[@]}"; do
+    input=$test/input_files
+    expected=$test/output_files
+    if [ ! -d "$input" ] || [ ! -d "$expected" ]; then
+        echo "$test: not a test"
+        failed=$((failed + 1))
+        continue
+    fi
+
+    before=$(ls "$input")
+    runs=("trace.txt vector_table.txt device_table.txt external_files.txt")
+    if [ -f "$input/runs.txt" ]; then
+        mapfile -t runs < "$input/runs.txt"
+    fi
+
+    result=ok
+    for run in "${runs[@]}"; do
+        [ -z "$run" ] && continue
+        if ! (cd "$input" && $interrupts $run > stdout.txt 2>&1); then
+            result="FAILED (interrupts $run)"
+            break
+        fi
+    done
+
+    if [ "$result" == ok ]; then
+        for file in $(ls "$expected"); do
+            if ! cmp -s "$input/$file" "$expected/$file"; then
+                result="FAILED ($file differs)"
+                break
+            fi
+        done
+    fi
+
+    # remove what the runs wrote
+    for file in $(ls "$input"); do
+        if ! grep -qxF "$file" <<< "$before"; then
+            rm -f "$input/$file"
+        fi
+    done
+
+    echo "$test: $result"
+    [ "$result" == ok ] || failed=$((failed + 1))
+done
+
+if [ $failed -gt 0 ]; then
+    echo "$failed test(s) failed"
+    exit 1
+fi
+echo "all ${#tests[@]} tests passed"